@@ -26,36 +26,114 @@ def write_allocator(f):
     block_size = 1 << block_size_pow2
     chunk_size = 1 << 21
 
-    obj_sizes = [16, 24, 32, 56]
+    # Tuples are variable-size objects, 16 bytes plus 8 per item, so these
+    # include a class for each arity up to five
+    obj_sizes = [16, 24, 32, 40, 48, 56]
+    # Power-of-two buffers for the variable-size heap, which holds the backing
+    # stores of containers. Bigger buffers are allocated individually.
+    buffer_sizes = [16 << i for i in range(8)]
+    max_buffer_size = buffer_sizes[-1]
+    block_obj_sizes = sorted(set(obj_sizes) | set(buffer_sizes))
 
     f.write("""
 #define BLOCK_SIZE (%s)
 #define CHUNK_SIZE (%s)
 
+// Whether chunks should be backed by transparent huge pages. This can be
+// overridden at run time by the PYTHONC_HUGE_PAGES environment variable.
+#ifndef PYTHONC_HUGE_PAGES
+#define PYTHONC_HUGE_PAGES (0)
+#endif
+
 typedef unsigned char byte;
 
+__attribute((noreturn)) void error(const char *msg, ...);
+
 uint32_t bitscan64(uint64_t r) {
    asm ("bsfq %%0, %%0" : "=r" (r) : "0" (r));
    return r;
 }
 static byte *alloc_chunk_start, *alloc_chunk_end;
 
+// Set while several threads are marking, so live bits get set atomically
+static bool parallel_marking;
+
+// Release any memory a dead object owns outside of the arena
+void finalize_obj(void *object);
+
+// Buffers too big for an arena block, kept in a list for sweeping
+struct large_buffer {
+    large_buffer *next;
+    uint64_t size;
+    uint64_t live;
+    uint64_t old;
+};
+static large_buffer *large_buffers;
+
+// Empty blocks that have been given back to the OS, to be reused by any size
+// class before new chunks get mapped
+static byte **free_blocks;
+static size_t n_free_blocks, free_blocks_capacity;
+static uint64_t n_chunks;
+
+// Chunks are mapped aligned to their size, so the kernel can back each one
+// with a huge page
 static inline void alloc_chunk() {
-    alloc_chunk_start = new byte[CHUNK_SIZE];
-    alloc_chunk_end = alloc_chunk_start + CHUNK_SIZE;
-    // Align the start of the chunk
-    alloc_chunk_start = (byte *)(((uint64_t)alloc_chunk_start + BLOCK_SIZE - 1) & ~(BLOCK_SIZE - 1));
+    byte *p = (byte *)mmap(NULL, 2 * CHUNK_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        error("out of memory");
+    byte *start = (byte *)(((uint64_t)p + CHUNK_SIZE - 1) & ~(uint64_t)(CHUNK_SIZE - 1));
+    if (start > p)
+        munmap(p, start - p);
+    munmap(start + CHUNK_SIZE, p + CHUNK_SIZE - start);
+#ifdef MADV_HUGEPAGE
+    const char *env = getenv("PYTHONC_HUGE_PAGES");
+    if (env ? atoi(env) : PYTHONC_HUGE_PAGES)
+        madvise(start, CHUNK_SIZE, MADV_HUGEPAGE);
+#endif
+    alloc_chunk_start = start;
+    alloc_chunk_end = start + CHUNK_SIZE;
+    n_chunks++;
+}
+
+static inline byte *alloc_raw_block() {
+    if (n_free_blocks)
+        return free_blocks[--n_free_blocks];
+    if (alloc_chunk_end - alloc_chunk_start < BLOCK_SIZE)
+        alloc_chunk();
+    byte *p = alloc_chunk_start;
+    alloc_chunk_start += BLOCK_SIZE;
+    return p;
+}
+
+// The pages come back zeroed when the block is reused
+static void release_block(void *block) {
+    madvise(block, BLOCK_SIZE, MADV_DONTNEED);
+    if (n_free_blocks == free_blocks_capacity) {
+        free_blocks_capacity = free_blocks_capacity ? 2 * free_blocks_capacity : 256;
+        free_blocks = (byte **)realloc(free_blocks, free_blocks_capacity * sizeof(byte *));
+        if (!free_blocks)
+            error("out of memory");
+    }
+    free_blocks[n_free_blocks++] = (byte *)block;
 }
 """ % (block_size, chunk_size))
 
     # Write out "templates" of allocator arena blocks based on size
     ptr_size = 8 # HACK
-    capacity = block_size - ptr_size
+    # Header: next_block, next_free_block, next_dirty_block, cursor and list
+    # flags (padded to a pointer), live_count
+    capacity = block_size - 5 * ptr_size
 
-    for obj_size in obj_sizes:
-        n_objects = (capacity * 8 // (obj_size * 8 + 1))
+    for obj_size in block_obj_sizes:
+        # Each object needs a live bit, a finalize bit, and an old bit
+        n_objects = (capacity * 8 // (obj_size * 8 + 3))
+        # The bitmaps are rounded up to whole words
+        while n_objects * obj_size + 3 * ((n_objects + 63) // 64) * 8 > capacity:
+            n_objects -= 1
         n_live = (n_objects + 63) // 64
-        padding = capacity - (n_objects * obj_size + n_live * 8)
+        padding = capacity - (n_objects * obj_size + 3 * n_live * 8)
 
         f.write("""
 class arena_block_{obj_size} {{
@@ -66,39 +144,153 @@ public:
 
     byte data[n_objects][obj_size];
     uint64_t live_bits[n_live];
+    // Objects that need finalize_obj() called when they die
+    uint64_t finalize_bits[n_live];
+    // Objects that survived the last collection, i.e. the old generation.
+    // Old objects in the remembered set have their bit cleared.
+    uint64_t old_bits[n_live];
     arena_block_{obj_size} *next_block;
+    // Next block with free objects, in the list added to by sweep()
+    arena_block_{obj_size} *next_free_block;
+    // Next block that has had objects allocated or remembered in it since the
+    // last collection. Only these blocks can have young objects.
+    arena_block_{obj_size} *next_dirty_block;
+    // Index of the first live_bits word that might have a free object
+    uint32_t cursor;
+    bool on_free_list;
+    bool on_dirty_list;
+    // Number of live objects at the last sweep()
+    uint64_t live_count;
     byte padding[{padding_size}];
 
+    // All blocks, the blocks that had free objects when they were last swept,
+    // and the dirty blocks
     static arena_block_{obj_size} *head;
+    static arena_block_{obj_size} *free_head;
+    static arena_block_{obj_size} *dirty_head;
+    // Block that objects are currently allocated from
+    static arena_block_{obj_size} *current;
+    // Total live objects in all blocks, as of the last sweep()
+    static uint64_t live_objects;
+    // Statistics: objects ever allocated, and blocks in use
+    static uint64_t n_allocated;
+    static uint64_t n_blocks;
 
     static inline arena_block_{obj_size} *alloc_block() {{
-        if (alloc_chunk_end - alloc_chunk_start < BLOCK_SIZE)
-            alloc_chunk();
-
-        auto p = (arena_block_{obj_size} *)alloc_chunk_start;
-        alloc_chunk_start += BLOCK_SIZE;
+        auto p = (arena_block_{obj_size} *)alloc_raw_block();
         p->mark_dead();
+        p->clear_finalize_bits();
+        p->promote();
+        p->on_free_list = false;
+        p->on_dirty_list = false;
+        p->live_count = 0;
+        n_blocks++;
         return p;
     }}
 
-    static void *alloc_obj() {{
-        auto block = arena_block_{obj_size}::head;
-        void *p = block->get_next_obj();
-        if (!p) {{
-            block = alloc_block();
-            block->next_block = arena_block_{obj_size}::head;
-            arena_block_{obj_size}::head = block;
+    void mark_dirty() {{
+        if (!this->on_dirty_list) {{
+            this->on_dirty_list = true;
+            this->next_dirty_block = dirty_head;
+            dirty_head = this;
+        }}
+    }}
+
+    static void *alloc_obj(bool needs_finalize) {{
+        void *p = current->get_next_obj();
+        while (!p) {{
+            // Move on to the next block with free objects, or a new block if
+            // there aren't any left
+            auto block = free_head;
+            if (block) {{
+                free_head = block->next_free_block;
+                block->on_free_list = false;
+            }}
+            else {{
+                block = alloc_block();
+                block->next_block = head;
+                head = block;
+            }}
+            current = block;
+            block->mark_dirty();
             p = block->get_next_obj();
         }}
+        if (needs_finalize)
+            current->set_finalize_bit(p);
+        n_allocated++;
         return p;
     }}
 
+    // After a minor collection, only dirty blocks need to be swept, since
+    // nothing else could have died. A major collection rebuilds the free
+    // list, and gives empty blocks back to the OS, past the first
+    // (retain_bytes) worth that are kept for reuse. Returns the number of
+    // live objects.
+    static uint64_t sweep(bool minor, uint64_t &retain_bytes) {{
+        if (minor) {{
+            for (auto *p = dirty_head; p; p = p->next_dirty_block) {{
+                p->on_dirty_list = false;
+                p->sweep_block();
+                if (p != current)
+                    p->add_to_free_list();
+            }}
+        }}
+        else {{
+            for (auto *p = dirty_head; p; p = p->next_dirty_block)
+                p->on_dirty_list = false;
+            free_head = NULL;
+            for (auto **link = &head; *link; ) {{
+                auto *p = *link;
+                p->on_free_list = false;
+                p->sweep_block();
+                if (p != current && !p->live_count) {{
+                    if (retain_bytes < BLOCK_SIZE) {{
+                        *link = p->next_block;
+                        release_block(p);
+                        n_blocks--;
+                        continue;
+                    }}
+                    retain_bytes -= BLOCK_SIZE;
+                }}
+                if (p != current)
+                    p->add_to_free_list();
+                link = &p->next_block;
+            }}
+        }}
+        // Start a new dirty list, with just the block being allocated from
+        dirty_head = NULL;
+        current->mark_dirty();
+        return live_objects;
+    }}
+    void sweep_block() {{
+        this->finalize_dead();
+        this->promote();
+        this->cursor = 0;
+        uint64_t live = this->count_live();
+        live_objects += live - this->live_count;
+        this->live_count = live;
+    }}
+    void add_to_free_list() {{
+        if (this->live_count < n_objects && !this->on_free_list) {{
+            this->on_free_list = true;
+            this->next_free_block = free_head;
+            free_head = this;
+        }}
+    }}
+
     void init() {{
         assert(sizeof(*this) == BLOCK_SIZE);
         assert(sizeof(this->live_bits) * 8 >= n_objects);
         mark_dead();
+        clear_finalize_bits();
+        promote();
+    }}
+    void clear_finalize_bits() {{
+        for (uint32_t t = 0; t < n_live; t++)
+            this->finalize_bits[t] = 0;
     }}
     void mark_dead() {{
+        this->cursor = 0;
         for (uint32_t t = 0; t < n_live - 1; t++)
             this->live_bits[t] = 0;
         // For the last chunk of live bits, some bits could represent objects past
@@ -106,8 +298,34 @@ public:
         // and thus not be used
         this->live_bits[n_live - 1] = -1ull << (n_objects & 63);
     }}
+    // For minor collections: only objects allocated since the last collection
+    // (and remembered old objects) are marked
+    void mark_young_dead() {{
+        this->cursor = 0;
+        memcpy(this->live_bits, this->old_bits, sizeof(this->live_bits));
+    }}
+    // Everything that survived a collection becomes old
+    void promote() {{
+        memcpy(this->old_bits, this->live_bits, sizeof(this->old_bits));
+    }}
+    bool is_old(void *object) {{
+        uint32_t idx = ((uint64_t)object & (BLOCK_SIZE - 1)) / obj_size;
+        return (this->old_bits[idx / 64] & (1ull << (idx & 63))) != 0ull;
+    }}
+    // Returns whether the object was old and not already remembered
+    bool remember(void *object) {{
+        uint32_t idx = ((uint64_t)object & (BLOCK_SIZE - 1)) / obj_size;
+        uint32_t t = idx / 64;
+        uint64_t bit = 1ull << (idx & 63);
+        if (!(this->old_bits[t] & bit))
+            return false;
+        this->old_bits[t] &= ~bit;
+        this->mark_dirty();
+        return true;
+    }}
     void *get_next_obj() {{
-        for (uint32_t t = 0; t < n_live; t++) {{
+        for (; this->cursor < n_live; this->cursor++) {{
+            uint64_t t = this->cursor;
             uint64_t dead = ~this->live_bits[t];
             if (dead) {{
                 uint32_t bit = bitscan64(dead);
@@ -118,53 +336,234 @@ public:
         }}
         return NULL;
     }}
+    uint64_t count_live() {{
+        uint64_t live = 0;
+        for (uint32_t t = 0; t < n_live; t++)
+            live += __builtin_popcountll(this->live_bits[t]);
+        // Don't count the always-set bits past the end of the block
+        return live - (n_live * 64 - n_objects);
+    }}
     bool mark_live(void *object) {{
         uint32_t idx = ((uint64_t)object & (BLOCK_SIZE - 1)) / obj_size;
         uint32_t t = idx / 64;
         uint64_t bit = 1ull << (idx & 63);
+        if (parallel_marking)
+            return (__atomic_fetch_or(&this->live_bits[t], bit, __ATOMIC_RELAXED) & bit) != 0ull;
         bool already_live = (this->live_bits[t] & bit) != 0ull;
         this->live_bits[t] |= bit;
         return already_live;
     }}
+    void set_finalize_bit(void *object) {{
+        uint32_t idx = ((uint64_t)object & (BLOCK_SIZE - 1)) / obj_size;
+        this->finalize_bits[idx / 64] |= 1ull << (idx & 63);
+    }}
+    // Finalize all objects that weren't marked live since the last mark_dead()
+    void finalize_dead() {{
+        for (uint32_t t = 0; t < n_live; t++) {{
+            uint64_t dead = this->finalize_bits[t] & ~this->live_bits[t];
+            if (!dead)
+                continue;
+            this->finalize_bits[t] &= this->live_bits[t];
+            while (dead) {{
+                uint32_t bit = bitscan64(dead);
+                finalize_obj(this->data[t * 64 + bit]);
+                dead &= dead - 1;
+            }}
+        }}
+    }}
 }};
 arena_block_{obj_size} *arena_block_{obj_size}::head;
+arena_block_{obj_size} *arena_block_{obj_size}::free_head;
+arena_block_{obj_size} *arena_block_{obj_size}::dirty_head;
+arena_block_{obj_size} *arena_block_{obj_size}::current;
+uint64_t arena_block_{obj_size}::live_objects;
+uint64_t arena_block_{obj_size}::n_allocated;
+uint64_t arena_block_{obj_size}::n_blocks;
 """.format(obj_size=obj_size, n_objects=n_objects, n_live=n_live, padding_size=padding))
 
+    # Objects go in the smallest block size they fit in
     def dispatch_objsize(size):
-        f.write('switch (%s) {\n' % size)
-        for obj_size in obj_sizes:
-            f.write('    case %s: {\n' % obj_size)
+        for i, obj_size in enumerate(block_obj_sizes):
+            f.write('        %sif (%s <= %s) {\n' % ('} else ' if i else '', size, obj_size))
             yield 'arena_block_%s' % obj_size
-            f.write('    } break;\n')
-        f.write('    default: assert(!"bad obj size"); return NULL;\n')
-        f.write('}\n')
+        f.write('        }\n')
+        f.write('        assert(!"bad obj size");\n')
+        f.write('        return 0;\n')
+
+    def dispatch_buffer_size(size):
+        f.write('        switch (%s) {\n' % size)
+        for buffer_size in buffer_sizes:
+            f.write('        case %s:\n' % buffer_size)
+            yield 'arena_block_%s' % buffer_size
+        f.write('        }\n')
+
+    f.write('struct size_class_stats {\n')
+    f.write('    uint64_t obj_size, allocated, live, blocks;\n')
+    f.write('};\n')
 
     f.write('class allocator {\n')
     f.write('public:\n')
+    f.write('    static const int n_size_classes = %s;\n' % len(block_obj_sizes))
+    f.write('    // Bytes allocated since the last sweep, and bytes live after it\n')
+    f.write('    uint64_t allocated_bytes, live_bytes;\n')
 
     f.write('    allocator() {\n')
-    for obj_size in obj_sizes:
+    f.write('        allocated_bytes = live_bytes = 0;\n')
+    for obj_size in block_obj_sizes:
         f.write('        arena_block_%s::head = arena_block_%s::alloc_block();\n' % (obj_size, obj_size))
         f.write('        arena_block_%s::head->next_block = NULL;\n' % obj_size)
+        f.write('        arena_block_%s::current = arena_block_%s::head;\n' % (obj_size, obj_size))
+        f.write('        arena_block_%s::current->mark_dirty();\n' % obj_size)
     f.write('    }\n')
 
     f.write('    template<class T>\n')
     f.write('    T *alloc_obj() {\n')
     for t in dispatch_objsize('sizeof(T)'):
-        f.write('        return (T *)%s::alloc_obj();\n' % (t))
+        f.write('            allocated_bytes += %s::obj_size;\n' % t)
+        f.write('            return (T *)%s::alloc_obj(!std::is_trivially_destructible<T>::value);\n' % t)
+    f.write('    }\n')
+
+    # With several GC threads, each one resets every (n_threads)th block
+    f.write('    void mark_dead(bool minor, int thread = 0, int n_threads = 1) {\n')
+    f.write('        uint64_t i = 0;\n')
+    for obj_size in block_obj_sizes:
+        f.write('        if (minor) {\n')
+        f.write('            for (auto *p = arena_block_%s::dirty_head; p; p = p->next_dirty_block, i++)\n' % obj_size)
+        f.write('                if (i % n_threads == (uint64_t)thread)\n')
+        f.write('                    p->mark_young_dead();\n')
+        f.write('        }\n')
+        f.write('        else {\n')
+        f.write('            for (auto *p = arena_block_%s::head; p; p = p->next_block, i++)\n' % obj_size)
+        f.write('                if (i % n_threads == (uint64_t)thread)\n')
+        f.write('                    p->mark_dead();\n')
+        f.write('        }\n')
+    f.write('        if (thread == 0)\n')
+    f.write('            for (auto *p = large_buffers; p; p = p->next)\n')
+    f.write('                p->live = minor ? p->old : 0;\n')
     f.write('    }\n')
 
-    f.write('    void mark_dead() {\n')
-    for obj_size in obj_sizes:
-        f.write('        for (auto *p = arena_block_%s::head; p; p = p->next_block)\n' % obj_size)
-        f.write('            p->mark_dead();\n')
+    # After marking, finalize dead objects, free dead large buffers, and find
+    # the blocks that have objects to reuse
+    f.write('    void sweep(bool minor, uint64_t retain_bytes) {\n')
+    f.write('        allocated_bytes = live_bytes = 0;\n')
+    for obj_size in block_obj_sizes:
+        f.write('        live_bytes += arena_block_%s::sweep(minor, retain_bytes) * %s;\n' % (obj_size, obj_size))
+    f.write("""\
+        for (large_buffer **p = &large_buffers; *p; ) {
+            large_buffer *buffer = *p;
+            if (buffer->live) {
+                buffer->old = 1;
+                live_bytes += buffer->size;
+                p = &buffer->next;
+            }
+            else {
+                *p = buffer->next;
+                delete[] (byte *)buffer;
+            }
+        }
+""")
     f.write('    }\n')
 
     f.write('    template<size_t bytes>\n')
     f.write('    bool mark_live(void *object) {\n')
     f.write('        void *block = (void *)((uint64_t)object & ~(BLOCK_SIZE - 1));\n')
     for t in dispatch_objsize('bytes'):
-        f.write('        return ((%s *)block)->mark_live(object);\n' % t)
+        f.write('            return ((%s *)block)->mark_live(object);\n' % t)
+    f.write('    }\n')
+
+    for fn in ['is_old', 'remember']:
+        f.write('    template<size_t bytes>\n')
+        f.write('    bool %s(void *object) {\n' % fn)
+        f.write('        void *block = (void *)((uint64_t)object & ~(BLOCK_SIZE - 1));\n')
+        for t in dispatch_objsize('bytes'):
+            f.write('            return ((%s *)block)->%s(object);\n' % (t, fn))
+        f.write('    }\n')
+
+    # Variable-size objects, which go in the smallest block they fit in like
+    # fixed-size ones, or are allocated individually like large buffers. The
+    # size is passed back in when marking, like for buffers.
+    f.write('    void *alloc_var_obj(size_t bytes) {\n')
+    f.write('        if (bytes > %s)\n' % max_buffer_size)
+    f.write('            return alloc_buffer(bytes);\n')
+    for t in dispatch_objsize('bytes'):
+        f.write('            allocated_bytes += %s::obj_size;\n' % t)
+        f.write('            return %s::alloc_obj(false);\n' % t)
+    f.write('    }\n')
+
+    f.write('    bool mark_var_obj_live(void *object, size_t bytes) {\n')
+    f.write('        if (bytes > %s)\n' % max_buffer_size)
+    f.write('            return __atomic_exchange_n(&((large_buffer *)object - 1)->live, 1, __ATOMIC_RELAXED) != 0;\n')
+    f.write('        void *block = (void *)((uint64_t)object & ~(BLOCK_SIZE - 1));\n')
+    for t in dispatch_objsize('bytes'):
+        f.write('            return ((%s *)block)->mark_live(object);\n' % t)
+    f.write('    }\n')
+
+    # Large objects are old until remembered, like the ones in blocks
+    f.write('    bool remember_var_obj(void *object, size_t bytes) {\n')
+    f.write('        if (bytes > %s) {\n' % max_buffer_size)
+    f.write('            large_buffer *buffer = (large_buffer *)object - 1;\n')
+    f.write('            bool old = buffer->old != 0;\n')
+    f.write('            buffer->old = 0;\n')
+    f.write('            return old;\n')
+    f.write('        }\n')
+    f.write('        void *block = (void *)((uint64_t)object & ~(BLOCK_SIZE - 1));\n')
+    for t in dispatch_objsize('bytes'):
+        f.write('            return ((%s *)block)->remember(object);\n' % t)
+    f.write('    }\n')
+
+    f.write('    bool is_var_obj_old(void *object, size_t bytes) {\n')
+    f.write('        if (bytes > %s)\n' % max_buffer_size)
+    f.write('            return ((large_buffer *)object - 1)->old != 0;\n')
+    f.write('        void *block = (void *)((uint64_t)object & ~(BLOCK_SIZE - 1));\n')
+    for t in dispatch_objsize('bytes'):
+        f.write('            return ((%s *)block)->is_old(object);\n' % t)
+    f.write('    }\n')
+
+    f.write('    void get_stats(size_class_stats *stats) {\n')
+    for i, obj_size in enumerate(block_obj_sizes):
+        t = 'arena_block_%s' % obj_size
+        f.write('        stats[%s] = {%s, %s::n_allocated, %s::live_objects, %s::n_blocks};\n' %
+                (i, obj_size, t, t, t))
+    f.write('    }\n')
+
+    # Variable-size heap. Buffer sizes must come from buffer_capacity(), and
+    # are passed back in when marking so the right block type can be found.
+    f.write("""\
+    static size_t buffer_capacity(size_t bytes) {
+        size_t capacity = %s;
+        while (capacity < bytes)
+            capacity <<= 1;
+        return capacity;
+    }
+    void *alloc_buffer(size_t bytes) {
+        allocated_bytes += bytes;
+        if (bytes > %s) {
+            auto buffer = (large_buffer *)new byte[sizeof(large_buffer) + bytes];
+            buffer->next = large_buffers;
+            buffer->size = bytes;
+            buffer->live = 1;
+            buffer->old = 0;
+            large_buffers = buffer;
+            return buffer + 1;
+        }
+""" % (buffer_sizes[0], max_buffer_size))
+    for t in dispatch_buffer_size('bytes'):
+        f.write('            return %s::alloc_obj(false);\n' % t)
+    f.write("""\
+        assert(!"bad buffer size");
+        return NULL;
+    }
+    void mark_buffer_live(void *buffer, size_t bytes) {
+        if (bytes > %s) {
+            __atomic_store_n(&((large_buffer *)buffer - 1)->live, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        void *block = (void *)((uint64_t)buffer & ~(BLOCK_SIZE - 1));
+""" % max_buffer_size)
+    for t in dispatch_buffer_size('bytes'):
+        f.write('            ((%s *)block)->mark_live(buffer);\n' % t)
+        f.write('            return;\n')
+    f.write('        assert(!"bad buffer size");\n')
     f.write('    }\n')
 
     f.write('} alloc;\n')
@@ -28,6 +28,7 @@ __attribute((noreturn)) void error(const char *msg, ...) {
     exit(1);
 }
 
+class class_def;
 class list;
 class string_const;
 
@@ -40,21 +41,220 @@ typedef int64_t int_t;
 #endif
 
 // XXX Any use of the STL is basically a big hack right now. Their use is slow
-// and bad and ugly, and since our GC doesn't call destructors by design, they
-// are leaking memory right now.
-typedef std::map<std::string, node *> attr_dict;
-typedef std::pair<node *, node *> node_pair;
-typedef std::map<int_t, node_pair> node_dict;
-typedef std::map<int_t, node *> node_set;
+// and bad and ugly, and objects that use them have to be finalized by the GC
+// (see FINALIZE_FN) to free their memory.
 typedef std::vector<node *> node_list;
 
+// Growable array of plain data, stored in the GC's variable-size heap. The
+// buffer isn't traced on its own: the owning object has to call mark_live()
+// on the vector (and mark any nodes in it) when it is marked. Buffers that
+// are outgrown are left for the GC to free.
+template<class T>
+class gc_vector {
+private:
+    // 32-bit sizes keep the vector to two words, so the containers that
+    // embed one stay in their size class next to the node header.
+    T *items;
+    uint32_t length;
+    uint32_t capacity;
+
+    void grow(size_t min_capacity) {
+        if (min_capacity > UINT32_MAX)
+            error("container too large");
+        size_t bytes = alloc.buffer_capacity(min_capacity * sizeof(T));
+        T *new_items = (T *)alloc.alloc_buffer(bytes);
+        if (this->length)
+            memcpy(new_items, this->items, this->length * sizeof(T));
+        this->items = new_items;
+        this->capacity = bytes / sizeof(T);
+    }
+
+public:
+    typedef T *iterator;
+
+    gc_vector(): items(NULL), length(0), capacity(0) {}
+    explicit gc_vector(size_t n): items(NULL), length(0), capacity(0) {
+        this->resize(n);
+    }
+    gc_vector(size_t n, const T *data): items(NULL), length(0), capacity(0) {
+        this->resize(n);
+        if (n)
+            memcpy(this->items, data, n * sizeof(T));
+    }
+
+    void mark_live() {
+        if (!this->items)
+            return;
+        // The capacity was rounded down from the buffer size if T's size
+        // isn't a power of two, so round it back up.
+        size_t bytes = this->capacity * sizeof(T);
+        if (sizeof(T) & (sizeof(T) - 1))
+            bytes = alloc.buffer_capacity(bytes);
+        alloc.mark_buffer_live(this->items, bytes);
+    }
+    // Use storage outside of the GC heap, for singletons, which are never
+    // marked. The vector can't grow after this.
+    void set_static(size_t n, const T *data) {
+        T *new_items = new T[n];
+        memcpy(new_items, data, n * sizeof(T));
+        this->items = new_items;
+        this->length = n;
+        this->capacity = n;
+    }
+
+    size_t size() const { return this->length; }
+    bool empty() const { return this->length == 0; }
+    T *data() { return this->items; }
+    T *begin() { return this->items; }
+    T *end() { return this->items + this->length; }
+    T &back() { return this->items[this->length - 1]; }
+    T &operator[](size_t i) { return this->items[i]; }
+
+    void reserve(size_t n) {
+        if (n > this->capacity)
+            this->grow(n);
+    }
+    void resize(size_t n) {
+        this->reserve(n);
+        if (n > this->length)
+            memset(this->items + this->length, 0, (n - this->length) * sizeof(T));
+        this->length = n;
+    }
+    void clear() { this->length = 0; }
+    bool full() { return this->length == this->capacity; }
+    void push_back(const T &item) {
+        if (this->length == this->capacity)
+            this->grow(2 * this->length + 1);
+        this->items[this->length++] = item;
+    }
+    void pop_back() { this->length--; }
+    T *insert(T *pos, T item) {
+        size_t idx = pos - this->items;
+        this->push_back(item);
+        memmove(this->items + idx + 1, this->items + idx,
+                (this->length - idx - 1) * sizeof(T));
+        this->items[idx] = item;
+        return this->items + idx;
+    }
+    T *erase(T *pos) {
+        memmove(pos, pos + 1, (this->end() - pos - 1) * sizeof(T));
+        this->length--;
+        return pos;
+    }
+};
+
 inline node *create_bool_const(bool b);
+inline node *create_int_const(int_t value);
 
 #define pc_new(T) new(alloc.alloc_obj<T>()) T
 
+// Small integers aren't allocated at all: they are stored directly in the
+// node pointer. Objects are always at least 8-byte aligned, so a pointer with
+// the low bit set holds a 63-bit signed integer in its upper bits. Integers
+// that don't fit in 63 bits fall back to a heap-allocated int_const. Code that
+// calls methods on a node that might be an int should go through node_ref.
+#define INT_TAG (1)
+
+inline bool is_tagged_int(node *n) {
+    return ((uintptr_t)n & INT_TAG) != 0;
+}
+inline int_t tagged_int_value(node *n) {
+    return (int_t)(intptr_t)n >> 1;
+}
+inline bool int_fits_tag(int_t value) {
+    return ((int_t)((uint64_t)value << 1) >> 1) == value;
+}
+inline node *tag_int(int_t value) {
+    return (node *)(((uint64_t)value << 1) | INT_TAG);
+}
+
+// Objects that have been marked live, but whose children haven't been marked
+// yet. Marking pushes objects here instead of recursing into them, so deep
+// structures can't overflow the C stack. Each marking thread has its own.
+class mark_stack {
+private:
+    node **items;
+    size_t length;
+    size_t capacity;
+
+public:
+    mark_stack(): items(NULL), length(0), capacity(0) {}
+    // Each GC worker thread has its own, freed when the thread exits
+    ~mark_stack() { free(this->items); }
+
+    void push(node *n) {
+        if (this->length == this->capacity) {
+            this->capacity = this->capacity ? 2 * this->capacity : 1024;
+            this->items = (node **)realloc(this->items, this->capacity * sizeof(node *));
+            if (!this->items)
+                error("out of memory for mark stack");
+        }
+        this->items[this->length++] = n;
+    }
+    size_t size() { return this->length; }
+    // Move the top n objects into out, to be handed to another thread
+    void pop_chunk(node **out, size_t n) {
+        this->length -= n;
+        memcpy(out, this->items + this->length, n * sizeof(node *));
+    }
+    inline void drain();
+};
+static thread_local mark_stack gc_mark_stack;
+
+// Pointers stored in old objects since the last collection. Minor collections
+// only mark young objects, and mark these as extra roots to find the young
+// objects that only old objects point to.
+static node_list gc_remembered;
+
+// Write barriers, called on an object before storing a pointer in it. Usually
+// just the stored pointer is remembered, but when the object's storage is
+// about to be reallocated, the whole object is, and gets scanned again at the
+// next minor collection.
+template<class T>
+inline void gc_write_barrier(T *obj) {
+    if (alloc.remember<sizeof(T)>(obj))
+        gc_remembered.push_back(obj);
+}
+template<class T>
+inline void gc_write_barrier(T *obj, node *value) {
+    if (!is_tagged_int(value) && alloc.is_old<sizeof(T)>(obj))
+        gc_remembered.push_back(value);
+}
+// The same for variable-size objects, which pass in their size
+inline void gc_var_write_barrier(node *obj, size_t bytes) {
+    if (alloc.remember_var_obj(obj, bytes))
+        gc_remembered.push_back(obj);
+}
+inline void gc_var_write_barrier(node *obj, size_t bytes, node *value) {
+    if (!is_tagged_int(value) && alloc.is_var_obj_old(obj, bytes))
+        gc_remembered.push_back(value);
+}
+
+// Type tags for the concrete classes the runtime checks for. Each of these
+// classes passes its tag to the node constructor, so type checks are a load
+// and a compare instead of a virtual call.
+enum node_tag: uint8_t {
+    TAG_OTHER,
+    TAG_BOOL,
+    TAG_DICT,
+    TAG_FILE,
+    TAG_FROZENSET,
+    TAG_FUNCTION,
+    TAG_INT,
+    TAG_LIST,
+    TAG_NONE,
+    TAG_OBJECT,
+    TAG_SET,
+    TAG_STR,
+    TAG_TUPLE,
+};
+
 class node {
 public:
-    node() { }
+    node_tag tag;
+
+    node(): tag(TAG_OTHER) { }
+    explicit node(node_tag tag): tag(tag) { }
     const char *node_type() { return type()->type_name(); }
 
     virtual void mark_live() { error("mark_live unimplemented for %s", this->node_type()); }
@@ -66,24 +266,36 @@ public:
 #define MARK_LIVE_SINGLETON_FN \
     virtual void mark_live() { }
 
-    // This one is kind of weird...
+    // This one is kind of weird... The children get marked later, when the
+    // object is popped off the mark stack.
 #define MARK_LIVE_CHILDREN \
     virtual void mark_live() { \
         if (!alloc.mark_live<sizeof(*this)>(this)) \
-            this->mark_live_children(); \
+            gc_mark_stack.push(this); \
     } \
-    inline void mark_live_children()
-
-    virtual bool is_bool() { return false; }
-    virtual bool is_dict() { return false; }
-    virtual bool is_file() { return false; }
-    virtual bool is_function() { return false; }
-    virtual bool is_int_const() { return false; }
-    virtual bool is_list() { return false; }
-    virtual bool is_tuple() { return false; }
-    virtual bool is_none() { return false; }
-    virtual bool is_set() { return false; }
-    virtual bool is_str() { return false; }
+    virtual void mark_live_children()
+
+    virtual void mark_live_children() { }
+
+    // Called by the GC on dead objects that aren't trivially destructible.
+    // Classes with STL members use FINALIZE_FN to run their destructor.
+    virtual void finalize() { error("finalize unimplemented for %s", this->node_type()); }
+
+#define FINALIZE_FN(T) \
+    virtual void finalize() { this->~T(); }
+
+    bool is_bool() { return this->tag == TAG_BOOL; }
+    bool is_dict() { return this->tag == TAG_DICT; }
+    bool is_file() { return this->tag == TAG_FILE; }
+    bool is_frozenset() { return this->tag == TAG_FROZENSET; }
+    bool is_function() { return this->tag == TAG_FUNCTION; }
+    bool is_int_const() { return this->tag == TAG_INT; }
+    bool is_list() { return this->tag == TAG_LIST; }
+    bool is_tuple() { return this->tag == TAG_TUPLE; }
+    bool is_none() { return this->tag == TAG_NONE; }
+    bool is_object() { return this->tag == TAG_OBJECT; }
+    bool is_set() { return this->tag == TAG_SET; }
+    bool is_str() { return this->tag == TAG_STR; }
     virtual bool bool_value() { error("bool_value unimplemented for %s", this->node_type()); return false; }
     virtual int_t int_value() { error("int_value unimplemented for %s", this->node_type()); return 0; }
     virtual std::string str_value() { error("str_value unimplemented for %s", this->node_type()); return NULL; }
@@ -159,6 +371,7 @@ public:
     virtual node *__getitem__(int index) { error("getitem unimplemented for %s", this->node_type()); return NULL; }
     virtual node *__iter__() { error("iter unimplemented for %s", this->node_type()); }
     virtual node *next() { error("next unimplemented for %s", this->node_type()); }
+    virtual bool next_unpack(int_t n, node **items);
     virtual void __setattr__(node *rhs, node *key) { error("setattr unimplemented for %s", this->node_type()); }
     virtual void __setitem__(node *key, node *value) { error("setitem unimplemented for %s", this->node_type()); }
     virtual node *__slice__(node *start, node *end, node *step) { error("slice unimplemented for %s", this->node_type()); return NULL; }
@@ -174,6 +387,46 @@ public:
     virtual const char *type_name() { error("type_name unimplemented for %s", this->node_type()); }
 };
 
+// Handle for calling methods on a node that might be a tagged int. Tagged ints
+// get a temporary int_const constructed on the stack, which lives until the end
+// of the full expression, so this never allocates. Use it like a pointer:
+// node_ref(n)->repr().
+class node_ref {
+private:
+    node *ptr;
+    uint64_t temp[3];
+
+public:
+    inline node_ref(node *n);
+
+    node *operator->() { return this->ptr; }
+};
+
+void finalize_obj(void *object) {
+    ((node *)object)->finalize();
+}
+
+inline void mark_node_live(node *n) {
+    if (!is_tagged_int(n))
+        n->mark_live();
+}
+
+inline bool node_bool_value(node *n) {
+    if (is_tagged_int(n))
+        return n != tag_int(0);
+    return n->bool_value();
+}
+
+inline int_t node_int_value(node *n) {
+    if (is_tagged_int(n))
+        return tagged_int_value(n);
+    return n->int_value();
+}
+
+inline bool node_is_int(node *n) {
+    return is_tagged_int(n) || n->is_int_const();
+}
+
 class builtin_class: public node {
 public:
     virtual const char *type_name() = 0;
@@ -181,6 +434,8 @@ public:
     MARK_LIVE_SINGLETON_FN
 
     virtual node *getattr(const char *key);
+    // The builtin method with the given ID, or NULL, for call_method()
+    virtual node *get_method(method_id id) { return NULL; }
 
     virtual std::string repr() {
         return std::string("<class '") + this->type_name() + "'>";
@@ -202,46 +457,49 @@ class name##_class: public builtin_class { \
 public: \
     virtual const char *type_name() { return #name; } \
     virtual node *getattr(const char *key); \
+    virtual node *get_method(method_id id); \
     virtual node *__call__(context *ctx, tuple *args, dict *kwargs); \
 }; \
 name##_class builtin_class_##name;
 LIST_BUILTIN_CLASSES(BUILTIN_CLASS)
 #undef BUILTIN_CLASS
 
+// A frame of the shadow stack: the symbol table of a function or module, plus
+// the root slots the translator laid out for temporaries that are live across
+// a collection. Frames link to their caller, so marking walks the whole stack.
 class context {
 private:
     uint32_t sym_len;
+    uint32_t root_len;
     node **symbols;
+    node **roots;
     context *parent_ctx;
 
-    node_list stack;
 public:
-    context(uint32_t size, node **symbols) {
+    context(uint32_t size, node **symbols, uint32_t n_roots = 0, node **roots = NULL) {
         this->parent_ctx = NULL;
         this->symbols = symbols;
         this->sym_len = size;
+        this->roots = roots;
+        this->root_len = n_roots;
     }
-    context(context *parent_ctx, uint32_t size, node **symbols) {
+    context(context *parent_ctx, uint32_t size, node **symbols,
+            uint32_t n_roots = 0, node **roots = NULL) {
         this->parent_ctx = parent_ctx;
         this->symbols = symbols;
         this->sym_len = size;
-    }
-
-    void push(node *n) {
-        this->stack.push_back(n);
-    }
-
-    void pop() {
-        this->stack.pop_back();
+        this->roots = roots;
+        this->root_len = n_roots;
     }
 
     void mark_live(bool free_ctx) {
         if (!free_ctx) {
             for (uint32_t i = 0; i < this->sym_len; i++)
                 if (this->symbols[i])
-                    this->symbols[i]->mark_live();
-            for (size_t i = 0; i < this->stack.size(); i++)
-                this->stack[i]->mark_live();
+                    mark_node_live(this->symbols[i]);
+            for (uint32_t i = 0; i < this->root_len; i++)
+                if (this->roots[i])
+                    mark_node_live(this->roots[i]);
         }
         if (this->parent_ctx)
             this->parent_ctx->mark_live(false);
@@ -261,11 +519,10 @@ public:
 class none_const : public node {
 public:
     // For some reason this causes errors without an argument to the constructor...
-    none_const(int_t value) { }
+    none_const(int_t value): node(TAG_NONE) { }
 
     MARK_LIVE_SINGLETON_FN
 
-    virtual bool is_none() { return true; }
     virtual bool bool_value() { return false; }
 
     virtual bool _eq(node *rhs);
@@ -280,20 +537,19 @@ class int_const : public node {
 public:
     int_t value;
 
-    explicit int_const(int_t v): value(v) {}
+    explicit int_const(int_t v): node(TAG_INT), value(v) {}
 
     MARK_LIVE_FN
 
-    virtual bool is_int_const() { return true; }
     virtual int_t int_value() { return this->value; }
     virtual bool bool_value() { return this->value != 0; }
 
 #define INT_OP(NAME, OP) \
     virtual int_t _##NAME(node *rhs) { \
-        return this->int_value() OP rhs->int_value(); \
+        return this->int_value() OP node_int_value(rhs); \
     } \
     virtual node *__##NAME##__(node *rhs) { \
-        return pc_new(int_const)(this->_##NAME(rhs)); \
+        return create_int_const(this->_##NAME(rhs)); \
     }
     INT_OP(add, +)
     INT_OP(and, &)
@@ -308,7 +564,7 @@ public:
 
 #define CMP_OP(NAME, OP) \
     virtual bool _##NAME(node *rhs) { \
-        return this->int_value() OP rhs->int_value(); \
+        return this->int_value() OP node_int_value(rhs); \
     } \
 
     CMP_OP(eq, ==)
@@ -320,7 +576,7 @@ public:
 
 #define INT_UNOP(NAME, OP) \
     virtual node *__##NAME##__() { \
-        return pc_new(int_const)(OP this->int_value()); \
+        return create_int_const(OP this->int_value()); \
     }
     INT_UNOP(invert, ~)
     INT_UNOP(pos, +)
@@ -328,10 +584,11 @@ public:
 
     virtual node *__abs__() {
         int_t ret = (this->value >= 0) ? this->value : -this->value;
-        return pc_new(int_const)(ret);
+        return create_int_const(ret);
     }
 
     virtual int_t hash() { return this->value; }
+    virtual node *getattr(const char *key);
     virtual std::string repr();
     virtual node *type() { return &builtin_class_int; }
 };
@@ -343,22 +600,42 @@ public:
     MARK_LIVE_SINGLETON_FN
 };
 
+// Stack-allocated stand-in for a tagged int, only created by node_ref
+class int_const_temp : public int_const {
+public:
+    int_const_temp(int_t value) : int_const(value) { }
+
+    MARK_LIVE_SINGLETON_FN
+};
+
+inline node_ref::node_ref(node *n) {
+    static_assert(sizeof(int_const_temp) <= sizeof(temp), "int_const_temp too big");
+    if (is_tagged_int(n))
+        n = new(this->temp) int_const_temp(tagged_int_value(n));
+    this->ptr = n;
+}
+
+inline node *create_int_const(int_t value) {
+    if (int_fits_tag(value))
+        return tag_int(value);
+    return pc_new(int_const)(value);
+}
+
 class bool_const: public node {
 public:
     bool value;
 
-    explicit bool_const(bool v): value(v) {}
+    explicit bool_const(bool v): node(TAG_BOOL), value(v) {}
 
     MARK_LIVE_SINGLETON_FN
 
-    virtual bool is_bool() { return true; }
     virtual bool bool_value() { return this->value; }
     virtual int_t int_value() { return (int_t)this->value; }
 
 #define BOOL_AS_INT_OP(NAME, OP) \
     virtual node *__##NAME##__(node *rhs) { \
-        if (rhs->is_int_const() || rhs->is_bool()) \
-            return pc_new(int_const)(this->int_value() OP rhs->int_value()); \
+        if (node_ref(rhs)->is_int_const() || node_ref(rhs)->is_bool()) \
+            return create_int_const(this->int_value() OP node_int_value(rhs)); \
         error(#NAME " error in bool"); \
         return NULL; \
     }
@@ -372,10 +649,10 @@ public:
 
 #define BOOL_INT_CHECK_OP(NAME, OP) \
     virtual node *__##NAME##__(node *rhs) { \
-        if (rhs->is_bool()) \
-            return pc_new(bool_const)((bool)(this->int_value() OP rhs->int_value())); \
-        else if (rhs->is_int_const()) \
-            return pc_new(int_const)(this->int_value() OP rhs->int_value()); \
+        if (node_ref(rhs)->is_bool()) \
+            return create_bool_const((bool)(this->int_value() OP node_int_value(rhs))); \
+        else if (node_ref(rhs)->is_int_const()) \
+            return create_int_const(this->int_value() OP node_int_value(rhs)); \
         error(#NAME " error in bool"); \
         return NULL; \
     }
@@ -386,8 +663,8 @@ public:
 
 #define BOOL_OP(NAME, OP) \
     virtual bool _##NAME(node *rhs) { \
-        if (rhs->is_int_const() || rhs->is_bool()) \
-            return this->int_value() OP rhs->int_value(); \
+        if (node_ref(rhs)->is_int_const() || node_ref(rhs)->is_bool()) \
+            return this->int_value() OP node_int_value(rhs); \
         error(#NAME " error in bool"); \
         return false; \
     }
@@ -403,19 +680,58 @@ public:
     virtual node *type() { return &builtin_class_bool; }
 };
 
+// Resolves slice bounds against a sequence of length len, like CPython:
+// negative bounds count from the end, and out-of-range ones are clamped.
+// Returns the number of items in the slice, and sets its start and step.
+inline int_t slice_indices(int_t len, node *start, node *end, node *step, int_t *lo_ret, int_t *st_ret) {
+    if ((!node_ref(start)->is_none() && !node_ref(start)->is_int_const()) ||
+        (!node_ref(end)->is_none() && !node_ref(end)->is_int_const()) ||
+        (!node_ref(step)->is_none() && !node_ref(step)->is_int_const()))
+        error("slice error");
+    int_t st = node_ref(step)->is_none() ? 1 : node_int_value(step);
+    if (st == 0)
+        error("slice step cannot be zero");
+    int_t bounds[2] = {st > 0 ? 0 : len - 1, st > 0 ? len : -1};
+    node *args[2] = {start, end};
+    for (int i = 0; i < 2; i++) {
+        if (node_ref(args[i])->is_none())
+            continue;
+        int_t x = node_int_value(args[i]);
+        if (x < 0) {
+            x += len;
+            if (x < 0)
+                x = st > 0 ? 0 : -1;
+        }
+        else if (x >= len)
+            x = st > 0 ? len : len - 1;
+        bounds[i] = x;
+    }
+    int_t lo = bounds[0], hi = bounds[1];
+    *lo_ret = lo;
+    *st_ret = st;
+    if (st > 0)
+        return lo < hi ? (hi - lo - 1) / st + 1 : 0;
+    return hi < lo ? (lo - hi - 1) / -st + 1 : 0;
+}
+
 class string_const : public node {
-public:
-    std::string value;
+protected:
+    uint32_t size;
+    const char *chars;
 
+    // For singletons and views, which set up their own value
+    string_const(): node(TAG_STR) {}
+
+public:
     class str_iter: public node {
     private:
         string_const *parent;
-        std::string::iterator it;
+        size_t idx;
 
     public:
         str_iter(string_const *s) {
             this->parent = s;
-            it = s->value.begin();
+            this->idx = 0;
         }
 
         MARK_LIVE_CHILDREN {
@@ -423,32 +739,43 @@ public:
         }
 
         virtual node *__iter__() { return this; }
-        virtual node *next() {
-            if (this->it == this->parent->value.end())
-                return NULL;
-            char ret[2];
-            ret[0] = *this->it;
-            ret[1] = 0;
-            ++this->it;
-            return pc_new(string_const)(ret);
-        }
+        virtual node *next();
         virtual node *type() { return &builtin_class_str_iterator; }
     };
 
-    explicit string_const(const char *x): value(x) {}
-    explicit string_const(std::string x): value(x) {}
+    // Strings on the GC heap keep their characters inline, right after the
+    // object, followed by a NUL so they can be used as a C string. Use
+    // create_string_const(), which allocates room for them.
+    explicit string_const(size_t len): node(TAG_STR), size(len), chars((const char *)(this + 1)) {
+        ((char *)this->chars)[len] = 0;
+    }
+
+    virtual void mark_live() { alloc.mark_var_obj_live(this, sizeof(string_const) + this->size + 1); }
 
-    MARK_LIVE_FN
+    size_t length() { return this->size; }
+    const char *begin() { return this->chars; }
+    const char *end() { return this->chars + this->size; }
 
-    virtual bool is_str() { return true; }
-    virtual std::string str_value() { return this->value; }
-    virtual bool bool_value() { return this->value.length() != 0; }
-    virtual const char *c_str() { return this->value.c_str(); }
+    // The string that owns the characters, which slices can share
+    virtual string_const *storage() { return this; }
+    string_const *substring(size_t lo, size_t len);
+
+    virtual std::string str_value() { return std::string(this->begin(), this->length()); }
+    virtual bool bool_value() { return this->length() != 0; }
+    virtual const char *c_str() { return this->chars; }
+
+    // Three-way comparison of the characters, like std::string::compare()
+    int compare(string_const *rhs) {
+        size_t len = std::min(this->length(), rhs->length());
+        if (int c = memcmp(this->begin(), rhs->begin(), len))
+            return c;
+        return (this->length() > rhs->length()) - (this->length() < rhs->length());
+    }
 
 #define STRING_OP(NAME, OP) \
     virtual bool _##NAME(node *rhs) { \
-        if (rhs->is_str()) \
-            return this->str_value() OP rhs->str_value(); \
+        if (!is_tagged_int(rhs) && rhs->is_str()) \
+            return this->compare((string_const *)rhs) OP 0; \
         error(#NAME " unimplemented"); \
         return false; \
     } \
@@ -464,39 +791,22 @@ public:
     virtual node *__add__(node *rhs);
     virtual node *__mul__(node *rhs);
 
-    virtual node *__getitem__(node *rhs) {
-        if (!rhs->is_int_const()) {
-            error("getitem unimplemented");
-            return NULL;
-        }
-        return pc_new(string_const)(value.substr(rhs->int_value(), 1));
-    }
+    virtual node *__getitem__(node *rhs);
     // FNV-1a algorithm
     virtual int_t hash() {
         int_t hashkey = 14695981039346656037ull;
-        for (auto it = this->value.begin(); it != this->value.end(); ++it) {
+        for (auto it = this->begin(); it != this->end(); ++it) {
             hashkey ^= *it;
             hashkey *= 1099511628211ll;
         }
         return hashkey;
     }
-    virtual int_t len() { return this->value.length(); }
-    virtual node *__slice__(node *start, node *end, node *step) {
-        if ((!start->is_none() && !start->is_int_const()) ||
-            (!end->is_none() && !end->is_int_const()) ||
-            (!step->is_none() && !step->is_int_const()))
-            error("slice error");
-        int_t lo = start->is_none() ? 0 : start->int_value();
-        int_t hi = end->is_none() ? value.length() : end->int_value();
-        int_t st = step->is_none() ? 1 : step->int_value();
-        if (st != 1)
-            error("slice step != 1 not supported for string");
-        return pc_new(string_const)(this->value.substr(lo, hi - lo + 1));
-    }
+    virtual int_t len() { return this->length(); }
+    virtual node *__slice__(node *start, node *end, node *step);
     virtual std::string repr() {
         bool has_single_quotes = false;
         bool has_double_quotes = false;
-        for (auto it = this->value.begin(); it != this->value.end(); ++it) {
+        for (auto it = this->begin(); it != this->end(); ++it) {
             char c = *it;
             if (c == '\'')
                 has_single_quotes = true;
@@ -505,7 +815,7 @@ public:
         }
         bool use_double_quotes = has_single_quotes && !has_double_quotes;
         std::string s(use_double_quotes ? "\"" : "'");
-        for (auto it = this->value.begin(); it != this->value.end(); ++it) {
+        for (auto it = this->begin(); it != this->end(); ++it) {
             char c = *it;
             if (c == '\n')
                 s += "\\n";
@@ -523,17 +833,24 @@ public:
         s += use_double_quotes ? "\"" : "'";
         return s;
     }
-    virtual std::string str() { return this->value; }
+    virtual std::string str() { return this->str_value(); }
     virtual node *type() { return &builtin_class_str; }
     virtual node *__iter__() { return pc_new(str_iter)(this); }
 };
 
+static_assert(sizeof(string_const) == 24, "string characters must follow the header");
+
 class string_const_singleton : public string_const {
 private:
     int_t hashkey;
 
 public:
-    string_const_singleton(std::string value, int_t hashkey) : string_const(value), hashkey(hashkey) { }
+    string_const_singleton(std::string value, int_t hashkey) : hashkey(hashkey) {
+        char *chars = new char[value.length() + 1];
+        memcpy(chars, value.c_str(), value.length() + 1);
+        this->size = value.length();
+        this->chars = chars;
+    }
 
     MARK_LIVE_SINGLETON_FN
 
@@ -542,19 +859,138 @@ public:
     }
 };
 
+string_const_singleton empty_string_singleton("", 14695981039346656037ull);
+
+// Preallocated strings for every character, so indexing and iterating over a
+// string don't allocate. Like the singletons, they're outside the GC heap.
+class char_string: public string_const {
+private:
+    char value[2];
+
+public:
+    void set(char c) {
+        this->value[0] = c;
+        this->value[1] = 0;
+        this->size = 1;
+        this->chars = this->value;
+    }
+
+    MARK_LIVE_SINGLETON_FN
+};
+
+static class char_string_table {
+public:
+    char_string strings[256];
+
+    char_string_table() {
+        for (int c = 0; c < 256; c++)
+            this->strings[c].set(c);
+    }
+} char_strings;
+
+inline string_const *char_string_const(char c) {
+    return &char_strings.strings[(unsigned char)c];
+}
+
+// A slice of a string, which points into the characters of the string that
+// owns them instead of copying. Views aren't NUL-terminated, so asking for a
+// C string makes a copy, which the view then points to instead.
+class string_view: public string_const {
+private:
+    string_const *base;
+
+public:
+    string_view(string_const *base, const char *chars, size_t len): base(base) {
+        this->size = len;
+        this->chars = chars;
+    }
+
+    MARK_LIVE_CHILDREN {
+        this->base->mark_live();
+    }
+
+    virtual string_const *storage() { return this->base; }
+    virtual const char *c_str();
+};
+
+inline string_const *create_string_const(const char *x, size_t len) {
+    if (len <= 1)
+        return len ? char_string_const(x[0]) : &empty_string_singleton;
+    if (len > UINT32_MAX)
+        error("string too large");
+    string_const *ret = new(alloc.alloc_var_obj(sizeof(string_const) + len + 1)) string_const(len);
+    memcpy((char *)ret->begin(), x, len);
+    return ret;
+}
+inline string_const *create_string_const(const char *x) {
+    return create_string_const(x, strlen(x));
+}
+inline string_const *create_string_const(const std::string &x) {
+    return create_string_const(x.data(), x.length());
+}
+
+// Short slices are copied: the copy is no bigger than a view, and doesn't
+// keep the whole string alive
+string_const *string_const::substring(size_t lo, size_t len) {
+    if (len == this->length())
+        return this;
+    if (sizeof(string_const) + len + 1 <= sizeof(string_view))
+        return create_string_const(this->begin() + lo, len);
+    return pc_new(string_view)(this->storage(), this->begin() + lo, len);
+}
+
+const char *string_view::c_str() {
+    string_const *copy = create_string_const(this->begin(), this->length());
+    gc_write_barrier(this, copy);
+    this->base = copy;
+    this->chars = copy->begin();
+    return this->chars;
+}
+
+node *string_const::str_iter::next() {
+    if (this->idx >= this->parent->length())
+        return NULL;
+    return char_string_const(this->parent->begin()[this->idx++]);
+}
+
+node *string_const::__getitem__(node *rhs) {
+    if (!node_ref(rhs)->is_int_const()) {
+        error("getitem unimplemented");
+        return NULL;
+    }
+    int_t len = this->length();
+    int_t idx = node_int_value(rhs);
+    if ((idx >= len) || (idx < -len))
+        error("string index out of range");
+    if (idx < 0)
+        idx += len;
+    return char_string_const(this->begin()[idx]);
+}
+
+node *string_const::__slice__(node *start, node *end, node *step) {
+    int_t lo, st;
+    int_t n = slice_indices(this->length(), start, end, step, &lo, &st);
+    if (st == 1)
+        return this->substring(lo, n);
+    std::string new_string;
+    for (int_t i = 0; i < n; i++, lo += st)
+        new_string += this->begin()[lo];
+    return create_string_const(new_string);
+}
+
 class bytes: public node {
 public:
-    std::vector<uint8_t> value;
+    gc_vector<uint8_t> value;
 
     class bytes_iter: public node {
     private:
         bytes *parent;
-        std::vector<uint8_t>::iterator it;
+        size_t idx;
 
     public:
         bytes_iter(bytes *b) {
             this->parent = b;
-            it = b->value.begin();
+            this->idx = 0;
         }
 
         MARK_LIVE_CHILDREN {
@@ -563,24 +999,26 @@ public:
 
         virtual node *__iter__() { return this; }
         virtual node *next() {
-            if (this->it == this->parent->value.end())
+            if (this->idx >= this->parent->value.size())
                 return NULL;
-            uint8_t ret = *this->it;
-            ++this->it;
-            return pc_new(int_const)(ret);
+            return create_int_const(this->parent->value[this->idx++]);
         }
         virtual node *type() { return &builtin_class_bytes_iterator; }
     };
 
     bytes() {}
     explicit bytes(size_t len): value(len) {}
-    bytes(size_t len, const uint8_t *data): value(len) {
-        memcpy(&value[0], data, len);
-    }
+    bytes(size_t len, const uint8_t *data): value(len, data) {}
 
-    MARK_LIVE_FN
+    MARK_LIVE_CHILDREN {
+        this->value.mark_live();
+    }
 
-    void append(uint8_t x) { this->value.push_back(x); }
+    void append(uint8_t x) {
+        if (this->value.full())
+            gc_write_barrier(this);
+        this->value.push_back(x);
+    }
 
     virtual bool bool_value() { return this->value.size() != 0; }
 
@@ -623,24 +1061,55 @@ public:
 
 class bytes_singleton: public bytes {
 public:
-    bytes_singleton(size_t len, const uint8_t *data): bytes(len, data) {}
+    bytes_singleton(size_t len, const uint8_t *data) {
+        this->value.set_static(len, data);
+    }
 
     MARK_LIVE_SINGLETON_FN
 };
 
+inline bool is_number(node *n) {
+    return is_tagged_int(n) || n->is_int_const() || n->is_bool();
+}
+
+// Equality for searches and hash lookups. Values of different types are just
+// unequal here (ints and bools aside), rather than an error from _eq().
+inline bool nodes_equal(node *a, node *b) {
+    if (a == b)
+        return true;
+    if (is_number(a) || is_number(b))
+        return is_number(a) && is_number(b) && node_int_value(a) == node_int_value(b);
+    if (a->is_str() != b->is_str())
+        return false;
+    return a->_eq(b);
+}
+
+// Storage strategies for lists, as in PyPy. The strategy says what every item
+// in the list is, and only ever widens as items are stored, so marking can
+// skip lists of tagged ints, and searches and sorts can compare the items
+// directly. A list that has had mixed items is just a list of objects.
+enum list_strategy: uint8_t {
+    LIST_EMPTY,
+    LIST_INTS,
+    LIST_STRS,
+    LIST_OBJECTS,
+};
+
 class list: public node {
 public:
-    node_list items;
+    // Declared first so it fits in the padding after the node header
+    list_strategy strategy;
+    gc_vector<node *> items;
 
     class list_iter: public node {
     private:
         list *parent;
-        node_list::iterator it;
+        size_t idx;
 
     public:
         list_iter(list *l) {
             this->parent = l;
-            it = l->items.begin();
+            this->idx = 0;
         }
 
         MARK_LIVE_CHILDREN {
@@ -649,21 +1118,40 @@ public:
 
         virtual node *__iter__() { return this; }
         virtual node *next() {
-            if (this->it == this->parent->items.end())
+            if (this->idx >= this->parent->items.size())
                 return NULL;
-            node *ret = *this->it;
-            ++this->it;
-            return ret;
+            return this->parent->items[this->idx++];
         }
         virtual node *type() { return &builtin_class_list_iterator; }
     };
 
-    list() {}
-    explicit list(int_t n): items(n) {}
+    list(): node(TAG_LIST), strategy(LIST_EMPTY) {}
+    // Literals are sized up front and filled in with set_item(), so an
+    // object in a root slot can have NULL items while it's being built.
+    explicit list(int_t n): node(TAG_LIST), strategy(LIST_EMPTY), items(n) {}
 
     MARK_LIVE_CHILDREN {
+        this->items.mark_live();
+        if (this->strategy == LIST_EMPTY || this->strategy == LIST_INTS)
+            return;
         for (size_t i = 0; i < this->items.size(); i++)
-            this->items[i]->mark_live();
+            if (this->items[i])
+                mark_node_live(this->items[i]);
+    }
+
+    // Widen the strategy to cover an item about to be stored
+    void note_item(node *item) {
+        if (this->strategy == LIST_OBJECTS)
+            return;
+        list_strategy s = is_tagged_int(item) ? LIST_INTS :
+            item->is_str() ? LIST_STRS : LIST_OBJECTS;
+        if (s != this->strategy)
+            this->strategy = this->strategy == LIST_EMPTY ? s : LIST_OBJECTS;
+    }
+    static list_strategy join_strategies(list_strategy a, list_strategy b) {
+        if (a == b || b == LIST_EMPTY)
+            return a;
+        return a == LIST_EMPTY ? b : LIST_OBJECTS;
     }
 
     int_t index(int_t base) {
@@ -675,16 +1163,55 @@ public:
         return base;
     }
     void append(node *item) {
+        if (this->items.full())
+            gc_write_barrier(this);
+        else
+            gc_write_barrier(this, item);
+        this->note_item(item);
         this->items.push_back(item);
     }
+    void set_item(size_t idx, node *item) {
+        gc_write_barrier(this, item);
+        this->note_item(item);
+        this->items[idx] = item;
+    }
     node *pop(int_t idx) {
         idx = this->index(idx);
         node *popped = this->items[idx];
         items.erase(this->items.begin() + idx);
         return popped;
     }
+    // Index of the first item at or after start that's equal to key, or -1
+    int_t find(node *key, size_t start = 0) {
+        size_t len = this->items.size();
+        if (this->strategy == LIST_INTS) {
+            // Ints that fit in a tag are always tagged, so other numbers
+            // can only be equal to items by value
+            if (is_tagged_int(key)) {
+                for (size_t i = start; i < len; i++)
+                    if (this->items[i] == key)
+                        return i;
+                return -1;
+            }
+            if (!is_number(key))
+                return -1;
+        }
+        else if (this->strategy == LIST_STRS) {
+            if (is_tagged_int(key) || !key->is_str())
+                return -1;
+            string_const *s = (string_const *)key;
+            for (size_t i = start; i < len; i++)
+                if (!((string_const *)this->items[i])->compare(s))
+                    return i;
+            return -1;
+        }
+        for (size_t i = start; i < len; i++)
+            if (nodes_equal(this->items[i], key))
+                return i;
+        return -1;
+    }
+    void sort(context *ctx = NULL, node *key = NULL, bool reverse = false);
 
-    virtual bool is_list() { return true; }
     virtual bool bool_value() { return this->items.size() != 0; }
 
     virtual node *__add__(node *rhs);
@@ -696,48 +1223,45 @@ public:
     virtual bool _ne(node *rhs) { return !_eq(rhs); }
 
     virtual bool contains(node *key) {
-        for (size_t i = 0; i < this->items.size(); i++) {
-            if (this->items[i]->_eq(key))
-                return true;
-        }
-        return false;
+        return this->find(key) >= 0;
     }
     virtual void __delitem__(node *rhs) {
-        if (!rhs->is_int_const()) {
+        if (!node_ref(rhs)->is_int_const()) {
             error("delitem unimplemented");
             return;
         }
-        auto f = items.begin() + this->index(rhs->int_value());
+        auto f = items.begin() + this->index(node_int_value(rhs));
         items.erase(f);
     }
     virtual node *__getitem__(int idx) {
         return this->items[this->index(idx)];
     }
     virtual node *__getitem__(node *rhs) {
-        if (!rhs->is_int_const()) {
+        if (!node_ref(rhs)->is_int_const()) {
             error("getitem unimplemented");
             return NULL;
         }
-        return this->__getitem__(rhs->int_value());
+        return this->__getitem__(node_int_value(rhs));
     }
     virtual int_t len() { return this->items.size(); }
     virtual void __setitem__(node *key, node *value) {
-        if (!key->is_int_const())
+        if (!node_ref(key)->is_int_const())
             error("error in list.setitem");
-        int_t idx = key->int_value();
-        items[this->index(idx)] = value;
+        int_t idx = node_int_value(key);
+        this->set_item(this->index(idx), value);
     }
     virtual node *__slice__(node *start, node *end, node *step) {
-        if ((!start->is_none() && !start->is_int_const()) ||
-            (!end->is_none() && !end->is_int_const()) ||
-            (!step->is_none() && !step->is_int_const()))
-            error("slice error");
-        int_t lo = start->is_none() ? 0 : start->int_value();
-        int_t hi = end->is_none() ? items.size() : end->int_value();
-        int_t st = step->is_none() ? 1 : step->int_value();
+        int_t lo, st;
+        int_t n = slice_indices(this->items.size(), start, end, step, &lo, &st);
         list *new_list = pc_new(list)();
-        for (; st > 0 ? (lo < hi) : (lo > hi); lo += st)
-            new_list->items.push_back(items[lo]);
+        new_list->strategy = this->strategy;
+        if (st == 1)
+            new_list->items = gc_vector<node *>(n, &this->items[lo]);
+        else {
+            new_list->items.resize(n);
+            for (int_t i = 0; i < n; i++, lo += st)
+                new_list->items[i] = this->items[lo];
+        }
         return new_list;
     }
     virtual std::string repr() {
@@ -747,7 +1271,7 @@ public:
             if (!first)
                 new_string += ", ";
             first = false;
-            new_string += (*it)->repr();
+            new_string += node_ref(*it)->repr();
         }
         new_string += "]";
         return new_string;
@@ -756,19 +1280,42 @@ public:
     virtual node *__iter__() { return pc_new(list_iter)(this); }
 };
 
+// A tuple's items, which are stored inline, right after the tuple object in
+// the same allocation. This sits at the end of the tuple, in the padding after
+// the node header, so the items start just past it. Tuples are immutable, so
+// the length is fixed when the tuple is created.
+class tuple_items {
+private:
+    uint32_t length;
+
+public:
+    explicit tuple_items(size_t n): length(n) {
+        memset(this->data(), 0, n * sizeof(node *));
+    }
+
+    size_t size() const { return this->length; }
+    bool empty() const { return this->length == 0; }
+    node **data() { return (node **)(this + 1); }
+    node **begin() { return this->data(); }
+    node **end() { return this->data() + this->length; }
+    node *&operator[](size_t i) { return this->data()[i]; }
+};
+
+inline tuple *create_tuple(int_t n);
+
 class tuple: public node {
 public:
-    node_list items;
+    tuple_items items;
 
     class tuple_iter: public node {
     private:
         tuple *parent;
-        node_list::iterator it;
+        size_t idx;
 
     public:
         tuple_iter(tuple *t) {
             this->parent = t;
-            it = t->items.begin();
+            this->idx = 0;
         }
 
         MARK_LIVE_CHILDREN {
@@ -777,23 +1324,26 @@ public:
 
         virtual node *__iter__() { return this; }
         virtual node *next() {
-            if (this->it == this->parent->items.end())
+            if (this->idx >= this->parent->items.size())
                 return NULL;
-            node *ret = *this->it;
-            ++this->it;
-            return ret;
+            return this->parent->items[this->idx++];
         }
         virtual node *type() { return &builtin_class_tuple_iterator; }
     };
 
-    tuple() {}
-    explicit tuple(int_t n): items(n) {}
+    // Use create_tuple(), which allocates room for the items
+    explicit tuple(int_t n): node(TAG_TUPLE), items(n) {}
 
-    virtual bool is_tuple() { return true; }
+    size_t alloc_size() { return sizeof(tuple) + this->items.size() * sizeof(node *); }
 
-    MARK_LIVE_CHILDREN {
+    virtual void mark_live() {
+        if (!alloc.mark_var_obj_live(this, this->alloc_size()))
+            gc_mark_stack.push(this);
+    }
+    virtual void mark_live_children() {
         for (size_t i = 0; i < this->items.size(); i++)
-            this->items[i]->mark_live();
+            if (this->items[i])
+                mark_node_live(this->items[i]);
     }
 
     int_t index(int_t base) {
@@ -805,8 +1355,11 @@ public:
         return base;
     }
 
-    void append(node *item) {
-        this->items.push_back(item);
+    // Tuples can get old while they're being filled in, if the items are
+    // computed by code that collects garbage, so this needs a barrier
+    void set_item(size_t idx, node *item) {
+        gc_var_write_barrier(this, this->alloc_size(), item);
+        this->items[idx] = item;
     }
 
     virtual bool bool_value() { return this->items.size() != 0; }
@@ -816,10 +1369,14 @@ public:
 
     virtual bool _eq(node *rhs);
     virtual bool _ne(node *rhs) { return !_eq(rhs); }
+    virtual bool _lt(node *rhs);
+    virtual bool _le(node *rhs);
+    virtual bool _gt(node *rhs);
+    virtual bool _ge(node *rhs);
 
     virtual bool contains(node *key) {
         for (size_t i = 0; i < this->items.size(); i++) {
-            if (this->items[i]->_eq(key))
+            if (node_ref(this->items[i])->_eq(key))
                 return true;
         }
         return false;
@@ -828,24 +1385,22 @@ public:
         return this->items[this->index(idx)];
     }
     virtual node *__getitem__(node *rhs) {
-        if (!rhs->is_int_const()) {
+        if (!node_ref(rhs)->is_int_const()) {
             error("getitem unimplemented");
             return NULL;
         }
-        return this->__getitem__(rhs->int_value());
+        return this->__getitem__(node_int_value(rhs));
     }
     virtual int_t len() { return this->items.size(); }
     virtual node *__slice__(node *start, node *end, node *step) {
-        if ((!start->is_none() && !start->is_int_const()) ||
-            (!end->is_none() && !end->is_int_const()) ||
-            (!step->is_none() && !step->is_int_const()))
-            error("slice error");
-        int_t lo = start->is_none() ? 0 : start->int_value();
-        int_t hi = end->is_none() ? items.size() : end->int_value();
-        int_t st = step->is_none() ? 1 : step->int_value();
-        tuple *new_tuple = pc_new(tuple)((hi - lo) / st);
-        for (int_t i = 0; st > 0 ? (lo < hi) : (lo > hi); lo += st, i++)
-            new_tuple->items[i] = items[lo];
+        int_t lo, st;
+        int_t n = slice_indices(this->items.size(), start, end, step, &lo, &st);
+        // Tuples are immutable, so a slice of all of one is the same tuple
+        if (st == 1 && n == (int_t)this->items.size())
+            return this;
+        tuple *new_tuple = create_tuple(n);
+        for (int_t i = 0; i < n; i++, lo += st)
+            new_tuple->items[i] = this->items[lo];
         return new_tuple;
     }
     virtual node *type() { return &builtin_class_tuple; }
@@ -856,7 +1411,7 @@ public:
             if (!first)
                 new_string += ", ";
             first = false;
-            new_string += (*it)->repr();
+            new_string += node_ref(*it)->repr();
         }
         if (this->items.size() == 1)
             new_string += ",";
@@ -866,42 +1421,159 @@ public:
     virtual node *__iter__() { return pc_new(tuple_iter)(this); }
 };
 
+static_assert(sizeof(tuple) == 16, "tuple items must follow the node header");
+
+inline tuple *create_tuple(int_t n) {
+    if (n > UINT32_MAX)
+        error("tuple too large");
+    return new(alloc.alloc_var_obj(sizeof(tuple) + n * sizeof(node *))) tuple(n);
+}
+
+// A tuple in a C++ frame instead of the GC heap. The translator uses these for
+// argument tuples that can't escape the call they're built for: callees copy
+// out the arguments they keep. It's never swept, so marking it (from a root
+// slot while it's being filled in) just marks the items. Items are stored
+// directly, without set_item(), since the tuple can't be old. The storage
+// array is where the inline items of a tuple of this size would be. A tuple
+// with a length only known at run time can use part of a bigger array.
+template<size_t N>
+class stack_tuple: public tuple {
+private:
+    node *storage[N ? N : 1];
+
+public:
+    stack_tuple(): tuple(N) {}
+    explicit stack_tuple(size_t n): tuple(n) {}
+
+    virtual void mark_live() {
+        for (size_t i = 0; i < this->items.size(); i++)
+            if (this->storage[i])
+                mark_node_live(this->storage[i]);
+    }
+};
+
+struct dict_entry {
+    int_t hash;
+    node *key;
+    node *value;
+};
+
+inline int_t key_hash(node *key) {
+    if (is_tagged_int(key))
+        return tagged_int_value(key);
+    return key->hash();
+}
+
+// Compact dict, laid out like CPython's: entries are stored densely in
+// insertion order along with their hashes, and an open-addressed table of
+// indices into them, with a power-of-two size, is probed to find keys.
+// Deleted entries keep their place with a NULL key until the next resize.
 class dict: public node {
+private:
+    enum { DICT_EMPTY = -1, DICT_DUMMY = -2, DICT_MIN_SIZE = 8 };
+
+    // Find the index slot holding an entry for key, or the empty slot that
+    // ends its probe sequence.
+    size_t probe(node *key, int_t hash) {
+        size_t mask = this->indices.size() - 1;
+        size_t perturb = (size_t)hash;
+        size_t i = (size_t)hash & mask;
+        for (;;) {
+            int32_t ix = this->indices[i];
+            if (ix == DICT_EMPTY)
+                return i;
+            if (ix >= 0) {
+                dict_entry &e = this->entries[ix];
+                if (e.key == key || (e.hash == hash && nodes_equal(e.key, key)))
+                    return i;
+            }
+            perturb >>= 5;
+            i = (i * 5 + perturb + 1) & mask;
+        }
+    }
+    size_t find_empty_slot(int_t hash) {
+        size_t mask = this->indices.size() - 1;
+        size_t perturb = (size_t)hash;
+        size_t i = (size_t)hash & mask;
+        while (this->indices[i] != DICT_EMPTY) {
+            perturb >>= 5;
+            i = (i * 5 + perturb + 1) & mask;
+        }
+        return i;
+    }
+    // Rebuild the index table with at least n slots, squeezing out deleted
+    // entries. Tables are kept at most 2/3 full.
+    void resize(size_t n) {
+        size_t size = DICT_MIN_SIZE;
+        while (size < n)
+            size <<= 1;
+        gc_write_barrier(this);
+        gc_vector<dict_entry> old_entries = this->entries;
+        this->entries = gc_vector<dict_entry>();
+        this->entries.reserve(size * 2 / 3);
+        this->indices = gc_vector<int32_t>(size);
+        memset(this->indices.data(), 0xff, size * sizeof(int32_t));
+        for (auto it = old_entries.begin(); it != old_entries.end(); ++it) {
+            if (!it->key)
+                continue;
+            this->indices[this->find_empty_slot(it->hash)] = this->entries.size();
+            this->entries.push_back(*it);
+        }
+    }
+
 public:
-    node_dict items;
+    gc_vector<dict_entry> entries;
+    gc_vector<int32_t> indices;
+    uint32_t used;
 
-    dict() {}
+    dict(): node(TAG_DICT), used(0) {}
 
     MARK_LIVE_CHILDREN {
-        for (auto it = this->items.begin(); it != this->items.end(); ++it) {
-            it->second.first->mark_live();
-            it->second.second->mark_live();
+        this->entries.mark_live();
+        this->indices.mark_live();
+        for (auto it = this->entries.begin(); it != this->entries.end(); ++it) {
+            if (it->key) {
+                mark_node_live(it->key);
+                mark_node_live(it->value);
+            }
         }
     }
 
     node *lookup(node *key) {
-        int_t hashkey;
-        if (key->is_int_const())
-            hashkey = key->int_value();
-        else
-            hashkey = key->hash();
-        auto it = this->items.find(hashkey);
-        if (it == this->items.end())
+        if (!this->used)
             return NULL;
-        node *k = it->second.first;
-        if (!k->_eq(key))
+        int32_t ix = this->indices[this->probe(key, key_hash(key))];
+        if (ix < 0)
             return NULL;
-        return it->second.second;
+        return this->entries[ix].value;
+    }
+    // Look up a string key without making a string object, for keyword
+    // arguments to builtins. Those dicts are tiny, so just scan the entries.
+    node *lookup_str(const char *key) {
+        size_t len = strlen(key);
+        for (auto it = this->entries.begin(); it != this->entries.end(); ++it) {
+            if (!it->key || is_tagged_int(it->key) || !it->key->is_str())
+                continue;
+            string_const *s = (string_const *)it->key;
+            if (s->length() == len && !memcmp(s->begin(), key, len))
+                return it->value;
+        }
+        return NULL;
     }
     dict *copy() {
         dict *ret = pc_new(dict)();
-        for (auto it = this->items.begin(); it != this->items.end(); ++it)
-            ret->items[it->first] = it->second;
+        ret->entries = gc_vector<dict_entry>(this->entries.size(), this->entries.data());
+        ret->indices = gc_vector<int32_t>(this->indices.size(), this->indices.data());
+        ret->used = this->used;
         return ret;
     }
+    void clear() {
+        this->entries = gc_vector<dict_entry>();
+        this->indices = gc_vector<int32_t>();
+        this->used = 0;
+    }
 
-    virtual bool is_dict() { return true; }
-    virtual bool bool_value() { return this->items.size() != 0; }
+    virtual bool bool_value() { return this->used != 0; }
 
     virtual bool contains(node *key) {
         return this->lookup(key) != NULL;
@@ -909,21 +1581,52 @@ public:
     virtual node *__getitem__(node *key) {
         node *value = this->lookup(key);
         if (value == NULL)
-            error("cannot find %s in dict", key->repr().c_str());
+            error("cannot find %s in dict", node_ref(key)->repr().c_str());
         return value;
     }
-    virtual int_t len() { return this->items.size(); }
+    virtual int_t len() { return this->used; }
     virtual void __setitem__(node *key, node *value) {
-        items[key->hash()] = node_pair(key, value);
+        int_t hash = key_hash(key);
+        if (this->used) {
+            int32_t ix = this->indices[this->probe(key, hash)];
+            if (ix >= 0) {
+                gc_write_barrier(this, value);
+                this->entries[ix].value = value;
+                return;
+            }
+        }
+        if (this->entries.size() * 3 >= this->indices.size() * 2)
+            this->resize(this->used * 3);
+        if (this->entries.full())
+            gc_write_barrier(this);
+        else {
+            gc_write_barrier(this, key);
+            gc_write_barrier(this, value);
+        }
+        this->indices[this->find_empty_slot(hash)] = this->entries.size();
+        this->entries.push_back({hash, key, value});
+        this->used++;
+    }
+    virtual void __delitem__(node *key) {
+        size_t i = this->used ? this->probe(key, key_hash(key)) : 0;
+        if (!this->used || this->indices[i] < 0)
+            error("cannot find %s in dict", node_ref(key)->repr().c_str());
+        dict_entry &e = this->entries[this->indices[i]];
+        e.key = NULL;
+        e.value = NULL;
+        this->indices[i] = DICT_DUMMY;
+        this->used--;
     }
     virtual std::string repr() {
         std::string new_string = "{";
         bool first = true;
-        for (auto it = this->items.begin(); it != this->items.end(); ++it) {
+        for (auto it = this->entries.begin(); it != this->entries.end(); ++it) {
+            if (!it->key)
+                continue;
             if (!first)
                 new_string += ", ";
             first = false;
-            new_string += it->second.first->repr() + ": " + it->second.second->repr();
+            new_string += node_ref(it->key)->repr() + ": " + node_ref(it->value)->repr();
         }
         new_string += "}";
         return new_string;
@@ -932,27 +1635,35 @@ public:
     virtual node *__iter__();
 };
 
-#define DICT_ITER(name, next_body) \
+// The iterators walk the entries by index, so they see a consistent view
+// even if the dict is resized under them.
+#define DICT_ITER(name, next_body, unpack_body) \
     class dict_##name##s_iter: public node { \
     private: \
         dict *parent; \
-        node_dict::iterator it; \
-    public: \
-        dict_##name##s_iter(dict *d) { \
-            this->parent = d; \
-            it = d->items.begin(); \
+        size_t idx; \
+        dict_entry *next_entry() { \
+            while (this->idx < this->parent->entries.size()) { \
+                dict_entry *e = &this->parent->entries[this->idx++]; \
+                if (e->key) \
+                    return e; \
+            } \
+            return NULL; \
         } \
+    public: \
+        dict_##name##s_iter(dict *d): parent(d), idx(0) { } \
         MARK_LIVE_CHILDREN { \
             this->parent->mark_live(); \
         } \
         virtual node *__iter__() { return this; } \
         virtual node *next() { \
-            if (this->it == this->parent->items.end()) \
+            dict_entry *e = this->next_entry(); \
+            if (!e) \
                 return NULL; \
             next_body \
-            ++this->it; \
             return ret; \
         } \
+        unpack_body \
         node *type() { return &builtin_class_dict_##name##iterator; } \
     }; \
     class dict_##name##s: public node { \
@@ -961,8 +1672,8 @@ public:
     public: \
         dict_##name##s(dict *d) : parent(d) { } \
         MARK_LIVE_CHILDREN { this->parent->mark_live(); } \
-        virtual bool bool_value() { return this->parent->items.size() != 0; } \
-        virtual int_t len() { return this->parent->items.size(); } \
+        virtual bool bool_value() { return this->parent->used != 0; } \
+        virtual int_t len() { return this->parent->used; } \
         virtual node *__iter__() { return pc_new(dict_##name##s_iter)(this->parent); } \
         virtual std::string repr() { \
             std::string new_string = "dict_" #name "s(["; \
@@ -972,7 +1683,7 @@ public:
                 if (!first) \
                     new_string += ", "; \
                 first = false; \
-                new_string += n->repr(); \
+                new_string += node_ref(n)->repr(); \
             } \
             new_string += "])"; \
             return new_string; \
@@ -982,163 +1693,522 @@ public:
 
 // Eek. Reaching the limits of cpp here... don't use any commas in these function bodies...
 DICT_ITER(key,
-    auto ret = this->it->second.first;
-)
+    auto ret = e->key;
+,)
 DICT_ITER(item,
-    tuple *ret = pc_new(tuple)(2);
-    ret->items[0] = this->it->second.first;
-    ret->items[1] = this->it->second.second;
+    tuple *ret = create_tuple(2);
+    ret->items[0] = e->key;
+    ret->items[1] = e->value;
+,
+    virtual bool next_unpack(int_t n, node **items) {
+        if (n != 2)
+            return node::next_unpack(n, items);
+        dict_entry *e = this->next_entry();
+        if (!e)
+            return false;
+        items[0] = e->key;
+        items[1] = e->value;
+        return true;
+    }
 )
 DICT_ITER(value,
-    auto ret = this->it->second.second;
-)
+    auto ret = e->value;
+,)
 
-class set: public node {
-public:
-    node_set items;
+struct set_entry {
+    int_t hash;
+    node *key;
+};
 
-    class set_iter: public node {
-    private:
-        set *parent;
-        node_set::iterator it;
+// Control bytes for the set's hash table. Full slots hold 7 bits of the
+// key's hash, so empty and deleted slots are the only ones with the sign bit
+// set. A group is the run of control bytes compared at once while probing.
+enum {
+    CTRL_EMPTY = -128,
+    CTRL_DELETED = -2,
+    CTRL_GROUP = 16,
+};
 
-    public:
-        set_iter(set *s) {
-            this->parent = s;
-            it = s->items.begin();
-        }
+class ctrl_group {
+private:
+#ifdef __SSE2__
+    __m128i ctrl;
 
-        MARK_LIVE_CHILDREN {
-            this->parent->mark_live();
-        }
+public:
+    explicit ctrl_group(const int8_t *p): ctrl(_mm_loadu_si128((const __m128i *)p)) {}
 
-        virtual node *__iter__() { return this; }
-        virtual node *next() {
-            if (this->it == this->parent->items.end())
-                return NULL;
-            node *ret = this->it->second;
-            ++this->it;
-            return ret;
+    // Bitmasks of the slots in the group that hold h2, or are empty, or
+    // are free for an insert
+    uint32_t match(int8_t h2) {
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(this->ctrl, _mm_set1_epi8(h2)));
+    }
+    uint32_t match_empty() { return this->match(CTRL_EMPTY); }
+    uint32_t match_free() { return _mm_movemask_epi8(this->ctrl); }
+#else
+    const int8_t *ctrl;
+
+public:
+    explicit ctrl_group(const int8_t *p): ctrl(p) {}
+
+    uint32_t match(int8_t h2) {
+        uint32_t mask = 0;
+        for (int i = 0; i < CTRL_GROUP; i++)
+            mask |= (uint32_t)(this->ctrl[i] == h2) << i;
+        return mask;
+    }
+    uint32_t match_empty() { return this->match(CTRL_EMPTY); }
+    uint32_t match_free() {
+        uint32_t mask = 0;
+        for (int i = 0; i < CTRL_GROUP; i++)
+            mask |= (uint32_t)(this->ctrl[i] < 0) << i;
+        return mask;
+    }
+#endif
+};
+
+// Swiss table: a power-of-two array of slots, and a parallel array of control
+// bytes that's scanned a group at a time, so most probes only touch slots
+// whose hash bits already match. The control bytes of the first group are
+// mirrored after the last one, so a group can be loaded at any slot. Removed
+// keys leave a deleted marker until the next resize.
+class set: public node {
+protected:
+    enum { SET_MIN_SIZE = CTRL_GROUP };
+
+    gc_vector<int8_t> ctrl;
+    gc_vector<set_entry> slots;
+    uint32_t used;
+    // Inserts into empty slots left before the table is over 7/8 full
+    uint32_t growth_left;
+
+    // Probing starts at the hash's own slot, so small ints are kept in
+    // order, as in CPython. Folding in the higher bits spreads out keys
+    // that only differ there.
+    static size_t h1(int_t hash) { return (uint64_t)hash ^ ((uint64_t)hash >> 7); }
+    static int8_t h2(int_t hash) { return (uint64_t)hash * 0x9e3779b97f4a7c15ull >> 57; }
+
+    void set_ctrl(size_t i, int8_t c) {
+        this->ctrl[i] = c;
+        if (i < CTRL_GROUP)
+            this->ctrl[this->slots.size() + i] = c;
+    }
+    // Find the first free slot along hash's probe sequence. Groups are
+    // visited at triangular offsets, which covers every group.
+    size_t find_free(int_t hash) {
+        size_t mask = this->slots.size() - 1;
+        size_t pos = h1(hash) & mask;
+        for (size_t step = CTRL_GROUP; ; step += CTRL_GROUP) {
+            uint32_t m = ctrl_group(&this->ctrl[pos]).match_free();
+            if (m)
+                return (pos + __builtin_ctz(m)) & mask;
+            pos = (pos + step) & mask;
+        }
+    }
+    // Rebuild the table with room for at least n keys, dropping deleted ones
+    void resize(size_t n) {
+        size_t size = SET_MIN_SIZE;
+        while (size / 8 * 7 < n)
+            size <<= 1;
+        gc_write_barrier(this);
+        gc_vector<int8_t> old_ctrl = this->ctrl;
+        gc_vector<set_entry> old_slots = this->slots;
+        this->ctrl = gc_vector<int8_t>(size + CTRL_GROUP);
+        memset(this->ctrl.data(), CTRL_EMPTY, size + CTRL_GROUP);
+        this->slots = gc_vector<set_entry>(size);
+        for (size_t i = 0; i < old_slots.size(); i++) {
+            if (old_ctrl[i] >= 0) {
+                set_entry &e = old_slots[i];
+                size_t j = this->find_free(e.hash);
+                this->set_ctrl(j, h2(e.hash));
+                this->slots[j] = e;
+            }
+        }
+        this->growth_left = size / 8 * 7 - this->used;
+    }
+    // Add a key that's known not to be in the set
+    void insert_new(int_t hash, node *key) {
+        if (!this->growth_left)
+            this->resize(2 * this->used + 1);
+        size_t i = this->find_free(hash);
+        if (this->ctrl[i] == CTRL_EMPTY)
+            this->growth_left--;
+        gc_write_barrier(this, key);
+        this->set_ctrl(i, h2(hash));
+        this->slots[i].hash = hash;
+        this->slots[i].key = key;
+        this->used++;
+    }
+    void erase(size_t i) {
+        this->set_ctrl(i, CTRL_DELETED);
+        this->slots[i].key = NULL;
+        this->used--;
+    }
+    void reserve(size_t n) {
+        if (n > this->used + this->growth_left)
+            this->resize(n);
+    }
+    // A new, empty set or frozenset, like this one, with room for n keys
+    set *new_like(size_t n);
+    // Take over the table of another set
+    void take(set *other) {
+        gc_write_barrier(this);
+        this->ctrl = other->ctrl;
+        this->slots = other->slots;
+        this->used = other->used;
+        this->growth_left = other->growth_left;
+    }
+    std::string items_repr() {
+        std::string new_string = "{";
+        bool first = true;
+        for (size_t i = 0; i < this->slots.size(); i++) {
+            if (this->ctrl[i] < 0)
+                continue;
+            if (!first)
+                new_string += ", ";
+            first = false;
+            new_string += node_ref(this->slots[i].key)->repr();
+        }
+        new_string += "}";
+        return new_string;
+    }
+
+public:
+    class set_iter: public node {
+    private:
+        set *parent;
+        size_t idx;
+
+    public:
+        set_iter(set *s): parent(s), idx(0) {}
+
+        MARK_LIVE_CHILDREN {
+            this->parent->mark_live();
+        }
+
+        virtual node *__iter__() { return this; }
+        virtual node *next() {
+            while (this->idx < this->parent->slots.size()) {
+                size_t i = this->idx++;
+                if (this->parent->ctrl[i] >= 0)
+                    return this->parent->slots[i].key;
+            }
+            return NULL;
         }
         virtual node *type() { return &builtin_class_set_iterator; }
     };
 
-    set() {}
+    set(): set(TAG_SET) {}
+    explicit set(node_tag tag): node(tag), used(0), growth_left(0) {}
 
     MARK_LIVE_CHILDREN {
-        for (auto it = this->items.begin(); it != this->items.end(); ++it)
-            it->second->mark_live();
+        this->ctrl.mark_live();
+        this->slots.mark_live();
+        for (size_t i = 0; i < this->slots.size(); i++)
+            if (this->ctrl[i] >= 0)
+                mark_node_live(this->slots[i].key);
     }
 
+    // Index of the slot holding key, or -1
+    int_t find(node *key, int_t hash) {
+        if (!this->used)
+            return -1;
+        size_t mask = this->slots.size() - 1;
+        size_t pos = h1(hash) & mask;
+        int8_t h = h2(hash);
+        for (size_t step = CTRL_GROUP; ; step += CTRL_GROUP) {
+            ctrl_group g(&this->ctrl[pos]);
+            for (uint32_t m = g.match(h); m; m &= m - 1) {
+                size_t i = (pos + __builtin_ctz(m)) & mask;
+                set_entry &e = this->slots[i];
+                if (e.key == key || (e.hash == hash && nodes_equal(e.key, key)))
+                    return i;
+            }
+            if (g.match_empty())
+                return -1;
+            pos = (pos + step) & mask;
+        }
+    }
     node *lookup(node *key) {
-        auto it = this->items.find(key->hash());
-        if ((it == this->items.end()) || !it->second->_eq(key))
-            return NULL;
-        return it->second;
+        int_t i = this->find(key, key_hash(key));
+        return i < 0 ? NULL : this->slots[i].key;
     }
     void add(node *key) {
-        items[key->hash()] = key;
+        int_t hash = key_hash(key);
+        if (this->find(key, hash) < 0)
+            this->insert_new(hash, key);
     }
     void discard(node *key) {
-        auto it = this->items.find(key->hash());
-        if ((it == this->items.end()) || !it->second->_eq(key))
-            return;
-        this->items.erase(it);
+        int_t i = this->find(key, key_hash(key));
+        if (i >= 0)
+            this->erase(i);
     }
     void remove(node *key) {
-        auto it = this->items.find(key->hash());
-        if ((it == this->items.end()) || !it->second->_eq(key))
+        int_t i = this->find(key, key_hash(key));
+        if (i < 0)
             error("element not in set");
-        this->items.erase(it);
+        this->erase(i);
+    }
+    void clear() {
+        gc_write_barrier(this);
+        this->ctrl = gc_vector<int8_t>();
+        this->slots = gc_vector<set_entry>();
+        this->used = 0;
+        this->growth_left = 0;
     }
     set *copy() {
         set *ret = pc_new(set)();
-        for (auto it = this->items.begin(); it != this->items.end(); ++it)
-            ret->items[it->first] = it->second;
+        ret->ctrl = gc_vector<int8_t>(this->ctrl.size(), this->ctrl.data());
+        ret->slots = gc_vector<set_entry>(this->slots.size(), this->slots.data());
+        ret->used = this->used;
+        ret->growth_left = this->growth_left;
         return ret;
     }
+    void update(node *iterable);
 
-    virtual bool is_set() { return true; }
-    virtual bool bool_value() { return this->items.size() != 0; }
+    // These take any set or frozenset, and check the smaller one against
+    // the larger where they can.
+    bool issubset(set *other);
+    bool isdisjoint(set *other);
+    void intersection_update(set *other);
+    void symmetric_difference_update(set *other);
+
+    virtual bool bool_value() { return this->used != 0; }
 
+    virtual node *__and__(node *rhs);
+    virtual node *__iand__(node *rhs);
     virtual node *__or__(node *rhs);
     virtual node *__ior__(node *rhs);
     virtual node *__sub__(node *rhs);
     virtual node *__isub__(node *rhs);
+    virtual node *__xor__(node *rhs);
+    virtual node *__ixor__(node *rhs);
 
     virtual bool _eq(node *rhs);
     virtual bool _ne(node *rhs) { return !_eq(rhs); }
+    virtual bool _le(node *rhs);
+    virtual bool _lt(node *rhs);
+    virtual bool _ge(node *rhs);
+    virtual bool _gt(node *rhs);
 
     virtual bool contains(node *key) {
-        return this->lookup(key) != NULL;
+        return this->find(key, key_hash(key)) >= 0;
     }
-    virtual int_t len() { return this->items.size(); }
+    virtual int_t len() { return this->used; }
     virtual std::string repr() {
-        if (!this->items.size())
+        if (!this->used)
             return "set()";
-        std::string new_string = "{";
-        bool first = true;
-        for (auto it = this->items.begin(); it != this->items.end(); ++it) {
-            if (!first)
-                new_string += ", ";
-            first = false;
-            new_string += it->second->repr();
-        }
-        new_string += "}";
-        return new_string;
+        return this->items_repr();
     }
     virtual node *type() { return &builtin_class_set; }
     virtual node *__iter__() { return pc_new(set_iter)(this); }
 };
 
-class object: public node {
+// The hash table is the same as set's; frozensets just never change after
+// they're built, so they can be hashed, and in-place operators make a new one.
+class frozenset: public set {
 public:
-    attr_dict attrs;
+    frozenset(): set(TAG_FROZENSET) {}
 
-    MARK_LIVE_CHILDREN {
-        for (auto it = this->attrs.begin(); it != this->attrs.end(); ++it) {
-            it->second->mark_live();
+    virtual node *__iand__(node *rhs) { return this->__and__(rhs); }
+    virtual node *__ior__(node *rhs) { return this->__or__(rhs); }
+    virtual node *__isub__(node *rhs) { return this->__sub__(rhs); }
+    virtual node *__ixor__(node *rhs) { return this->__xor__(rhs); }
+
+    // Independent of the order of the keys, mixing each hash first so
+    // that keys with nearby hashes don't cancel out
+    virtual int_t hash() {
+        uint64_t hashkey = 0;
+        for (size_t i = 0; i < this->slots.size(); i++) {
+            if (this->ctrl[i] >= 0) {
+                uint64_t h = this->slots[i].hash;
+                hashkey ^= (h ^ (h << 16) ^ 89869747) * 3644798167ull;
+            }
         }
+        hashkey ^= (this->used + 1) * 1927868237ull;
+        return hashkey * 69069 + 907133923;
+    }
+    virtual std::string repr() {
+        if (!this->used)
+            return "frozenset()";
+        return "frozenset(" + this->items_repr() + ")";
     }
+    virtual node *type() { return &builtin_class_frozenset; }
+};
 
-    virtual bool bool_value() { return true; }
-    virtual node *type() {
-        return this->getattr("__class__");
+inline bool is_set_like(node *n) {
+    return !is_tagged_int(n) && (n->is_set() || n->is_frozenset());
+}
+
+// Hidden classes, or shapes, as in Self and V8. Objects of a class that have
+// had the same attributes stored, in the same order, share a shape, which
+// maps the attribute names to slots in the objects. Each shape is an
+// attribute added to its parent's, and the root shape for a class's instances
+// points to the class, so the shape also says where to look for methods.
+// Shapes are never freed.
+class hidden_class {
+public:
+    hidden_class *parent;
+    class_def *cls;
+    const char *name;
+    uint32_t n_slots;
+    std::vector<hidden_class *> transitions;
+
+    explicit hidden_class(class_def *cls): parent(NULL), cls(cls), name(NULL), n_slots(0) {}
+    hidden_class(hidden_class *parent, const char *name): parent(parent), cls(parent->cls),
+        name(strdup(name)), n_slots(parent->n_slots + 1) {}
+
+    // Slot index of an attribute, or -1 if the shape doesn't have it
+    int_t find(const char *attr) {
+        for (hidden_class *s = this; s->parent; s = s->parent)
+            if (!strcmp(s->name, attr))
+                return s->n_slots - 1;
+        return -1;
     }
+    // The shape with an attribute added, shared with other objects that
+    // have had it added to this shape
+    hidden_class *add(const char *attr) {
+        for (size_t i = 0; i < this->transitions.size(); i++) {
+            hidden_class *s = this->transitions[i];
+            if (!strcmp(s->name, attr))
+                return s;
+        }
+        hidden_class *s = new hidden_class(this, attr);
+        this->transitions.push_back(s);
+        return s;
+    }
+};
 
-    node *lookup(const char *key) {
-        auto attr = std::string(key);
-        auto it = this->attrs.find(attr);
-        if (it == this->attrs.end())
-            return NULL;
-        return attrs[attr];
+// Inline caches for attribute accesses. Each Attribute and StoreAttr in the
+// program gets one, which remembers how the last few shapes seen there were
+// handled, so a hit is a compare and a load. Stores remember the shape the
+// object ends up with, which is different when the store adds the attribute.
+enum attr_cache_kind: uint8_t {
+    ATTR_SLOT,
+    ATTR_CLASS,
+};
+
+struct attr_cache_entry {
+    hidden_class *shape;
+    hidden_class *new_shape;
+    uint32_t index;
+    attr_cache_kind kind;
+};
+
+#define ATTR_CACHE_WAYS (4)
+
+struct attr_cache {
+    attr_cache_entry entries[ATTR_CACHE_WAYS];
+
+    attr_cache_entry *find(hidden_class *shape) {
+        for (int i = 0; i < ATTR_CACHE_WAYS; i++)
+            if (this->entries[i].shape == shape)
+                return &this->entries[i];
+        return NULL;
     }
-    virtual node *getattr(const char *key) {
-        auto attr = this->lookup(key);
-        if (!attr)
-            error("object has no attribute %s", key);
-        return attr;
+    // Most recently used entries go first
+    void insert(attr_cache_entry entry) {
+        memmove(&this->entries[1], &this->entries[0], (ATTR_CACHE_WAYS - 1) * sizeof(attr_cache_entry));
+        this->entries[0] = entry;
     }
-    void setattr(const char *attr, node *value) {
-        attrs[std::string(attr)] = value;
+};
+
+// Instances of user classes. The translator finds the attributes that the
+// methods of each class store on self, or takes them from __slots__, and
+// these are fields stored inline after the object, so an instance is a single
+// allocation. Fields that haven't been set yet are NULL. Any other attributes
+// go in a separate array. Both are laid out by the object's shape, which
+// starts out with the class's fields.
+class object: public node {
+public:
+    // Declared first so it fits in the padding after the node header
+    uint32_t n_fields;
+    hidden_class *shape;
+    node **extra;
+
+    // Use create_object(), which allocates room for the fields
+    object(hidden_class *s, uint32_t n_fields): node(TAG_OBJECT), n_fields(n_fields), shape(s), extra(NULL) {
+        memset(this->fields(), 0, n_fields * sizeof(node *));
+    }
+
+    size_t alloc_size() { return sizeof(object) + this->n_fields * sizeof(node *); }
+    node **fields() { return (node **)(this + 1); }
+    size_t n_extra() { return this->shape->n_slots - this->n_fields; }
+    node *get_slot(uint32_t idx) {
+        return idx < this->n_fields ? this->fields()[idx] : this->extra[idx - this->n_fields];
+    }
+
+    virtual void mark_live() {
+        if (!alloc.mark_var_obj_live(this, this->alloc_size()))
+            gc_mark_stack.push(this);
+    }
+    virtual void mark_live_children() {
+        for (uint32_t i = 0; i < this->n_fields; i++)
+            if (this->fields()[i])
+                mark_node_live(this->fields()[i]);
+        if (size_t n = this->n_extra()) {
+            alloc.mark_buffer_live(this->extra, alloc.buffer_capacity(n * sizeof(node *)));
+            for (size_t i = 0; i < n; i++)
+                mark_node_live(this->extra[i]);
+        }
+    }
+
+    virtual bool bool_value() { return true; }
+    virtual node *type();
+
+    // Attributes not found on the instance come from the class, with
+    // functions bound to the instance
+    node *bind(node *value);
+    virtual node *getattr(const char *key);
+    void set_slot(uint32_t idx, node *value) {
+        gc_var_write_barrier(this, this->alloc_size(), value);
+        if (idx < this->n_fields)
+            this->fields()[idx] = value;
+        else
+            this->extra[idx - this->n_fields] = value;
+    }
+    // Add an attribute that isn't a field, moving to the shape that has it.
+    // The extra array is sized by buffer_capacity(), so it's full when the
+    // count is a buffer size.
+    void add_slot(hidden_class *new_shape, node *value) {
+        size_t n = this->n_extra();
+        size_t bytes = n * sizeof(node *);
+        if (!n || bytes == alloc.buffer_capacity(bytes)) {
+            node **new_extra = (node **)alloc.alloc_buffer(alloc.buffer_capacity(bytes + sizeof(node *)));
+            if (n)
+                memcpy(new_extra, this->extra, bytes);
+            this->extra = new_extra;
+            gc_var_write_barrier(this, this->alloc_size());
+        }
+        else
+            gc_var_write_barrier(this, this->alloc_size(), value);
+        this->extra[n] = value;
+        this->shape = new_shape;
     }
+    void setattr(const char *attr, node *value);
     virtual void __setattr__(node *key, node *value) {
-        if (!key->is_str())
+        if (!node_ref(key)->is_str())
             error("setattr with non-string");
-        return this->setattr(key->c_str(), value);
+        return this->setattr(node_ref(key)->c_str(), value);
     }
     virtual bool _eq(node *rhs) { return this == rhs; }
     virtual bool _ne(node *rhs) { return this != rhs; }
+
+    void cache_attr(const char *key, attr_cache *cache);
+    node *load_attr_miss(node *name, attr_cache *cache);
+    void store_attr_miss(node *name, node *value, attr_cache *cache);
+    node *find_method(node *name, attr_cache *cache);
 };
 
+static_assert(sizeof(object) == 32, "object fields must follow the header");
+
 class file: public node {
 public:
     FILE *f;
 
-    file(FILE *file) {
+    file(FILE *file): node(TAG_FILE) {
         this->f = file;
     }
-    file(const char *path, const char *mode) {
+    file(const char *path, const char *mode): node(TAG_FILE) {
         f = fopen(path, mode);
         if (!f)
             error("%s: file not found", path);
@@ -1151,7 +2221,7 @@ public:
         if ((unsigned)len >= sizeof(buf))
             error("len too long");
         (void)fread(buf, 1, len, this->f);
-        return pc_new(string_const)(buf);
+        return create_string_const(buf);
     }
     void write(string_const *data) {
         size_t len = data->len();
@@ -1164,11 +2234,9 @@ public:
         static char buf[1 << 16];
         if (!fgets(buf, sizeof(buf), this->f))
             return NULL;
-        return pc_new(string_const)(buf);
+        return create_string_const(buf);
     }
 
-    virtual bool is_file() { return true; }
-
     virtual node *getattr(const char *key);
     virtual node *type() { return &builtin_class_file; }
 };
@@ -1193,11 +2261,21 @@ public:
         node *item = this->iter->next();
         if (!item)
             return NULL;
-        tuple *ret = pc_new(tuple)(2);
-        ret->items[0] = pc_new(int_const)(this->i++);
+        tuple *ret = create_tuple(2);
+        ret->items[0] = create_int_const(this->i++);
         ret->items[1] = item;
         return ret;
     }
+    virtual bool next_unpack(int_t n, node **items) {
+        if (n != 2)
+            return node::next_unpack(n, items);
+        node *item = this->iter->next();
+        if (!item)
+            return false;
+        items[0] = create_int_const(this->i++);
+        items[1] = item;
+        return true;
+    }
 
     virtual node *type() { return &builtin_class_enumerate; }
 };
@@ -1227,7 +2305,7 @@ private:
                 if (this->start <= this->end)
                     return NULL;
             }
-            node *ret = pc_new(int_const)(this->start);
+            node *ret = create_int_const(this->start);
             this->start += this->step;
             return ret;
         }
@@ -1309,16 +2387,145 @@ public:
         node *item2 = this->iter2->next();
         if (!item1 || !item2)
             return NULL;
-        tuple *ret = pc_new(tuple)(2);
+        tuple *ret = create_tuple(2);
         ret->items[0] = item1;
         ret->items[1] = item2;
         return ret;
     }
+    virtual bool next_unpack(int_t n, node **items) {
+        if (n != 2)
+            return node::next_unpack(n, items);
+        node *item1 = this->iter1->next();
+        node *item2 = this->iter2->next();
+        if (!item1 || !item2)
+            return false;
+        items[0] = item1;
+        items[1] = item2;
+        return true;
+    }
 
     virtual node *type() { return &builtin_class_zip; }
 };
 
 typedef node *(*fptr)(context *parent_ctx, tuple *args, dict *kwargs);
+typedef node *(*fixed_fptr)(context *parent_ctx, node **args);
+
+// Functions translated from Python have a fixed-arity entry point, which
+// takes an array with one argument for each parameter: the positional ones,
+// then the keyword-only ones, then a tuple of any extra positional arguments
+// for *args. Parameters with defaults can be NULL, and the callee fills in
+// the default. The generic entry point binds the arguments of a call to
+// the array with bind_arguments(), using this description of the function.
+struct function_info {
+    const char *name;
+    fixed_fptr fixed_function;
+    uint32_t n_args;
+    uint32_t n_required;
+    uint32_t n_kwonly;
+    bool has_vararg;
+    const char **arg_names;
+};
+
+void bind_arguments(const function_info *info, tuple *args, dict *kwargs, node **params) {
+    size_t len = args->items.size();
+    size_t n_params = info->n_args + info->n_kwonly;
+    size_t n_positional = std::min(len, (size_t)info->n_args);
+    if (len > info->n_args && !info->has_vararg)
+        error("too many arguments to %s()", info->name);
+    for (size_t i = 0; i < n_positional; i++)
+        params[i] = args->items[i];
+    for (size_t i = n_positional; i < n_params; i++)
+        params[i] = NULL;
+
+    if (kwargs && kwargs->used) {
+        uint32_t n_kwargs = 0;
+        for (size_t i = 0; i < n_params; i++) {
+            if (node *value = kwargs->lookup_str(info->arg_names[i])) {
+                if (params[i])
+                    error("%s() got multiple values for argument '%s'", info->name, info->arg_names[i]);
+                params[i] = value;
+                n_kwargs++;
+            }
+        }
+        if (n_kwargs != kwargs->used)
+            error("%s() got an unexpected keyword argument", info->name);
+    }
+    for (size_t i = 0; i < info->n_required; i++)
+        if (!params[i])
+            error("%s() missing required argument '%s'", info->name, info->arg_names[i]);
+
+    // The extra arguments get a new tuple, since the callee keeps it
+    if (info->has_vararg) {
+        tuple *rest = create_tuple(len - n_positional);
+        for (size_t i = n_positional; i < len; i++)
+            rest->items[i - n_positional] = args->items[i];
+        params[n_params] = rest;
+    }
+}
+
+// Functions. Calls with just the right number of positional arguments, and
+// no keyword arguments, go straight to the fixed-arity entry point of
+// functions that have one, which is all those translated from Python except
+// ones with *args or keyword-only arguments. Subclasses share the tag, so
+// they mustn't override __call__().
+class function_def : public node {
+public:
+    fptr base_function;
+    fixed_fptr fixed_function;
+    uint32_t n_args;
+
+    explicit function_def(fptr f): node(TAG_FUNCTION), base_function(f), fixed_function(NULL), n_args(0) {}
+    function_def(fptr f, const function_info *info): node(TAG_FUNCTION), base_function(f),
+        fixed_function(info->has_vararg || info->n_kwonly ? NULL : info->fixed_function),
+        n_args(info->n_args) {}
+
+    MARK_LIVE_FN
+
+    node *call(context *ctx, tuple *args, dict *kwargs) {
+        if (!kwargs && this->fixed_function && args->items.size() == this->n_args)
+            return this->fixed_function(ctx, args->items.data());
+        return this->base_function(ctx, args, kwargs);
+    }
+    virtual node *__call__(context *ctx, tuple *args, dict *kwargs) {
+        return this->call(ctx, args, kwargs);
+    }
+    virtual node *type() { return &builtin_class_function; }
+};
+
+inline node *call_function(context *ctx, node *fn, tuple *args, dict *kwargs) {
+    if (!is_tagged_int(fn) && fn->is_function())
+        return ((function_def *)fn)->call(ctx, args, kwargs);
+    return node_ref(fn)->__call__(ctx, args, kwargs);
+}
+
+// Call a method with self in front of the arguments. Callees copy out the
+// arguments they keep, so unless there are a lot of them, the new arguments
+// can go in the C++ frame: just an array, if the method has a fixed-arity
+// entry point that takes them.
+#define STACK_METHOD_ARGS (8)
+
+node *call_with_self(context *ctx, node *method, node *self, tuple *args, dict *kwargs) {
+    size_t len = args->items.size();
+    if (len < STACK_METHOD_ARGS) {
+        if (!kwargs && !is_tagged_int(method) && method->is_function()) {
+            function_def *fn = (function_def *)method;
+            if (fn->fixed_function && len + 1 == fn->n_args) {
+                node *new_args[STACK_METHOD_ARGS];
+                new_args[0] = self;
+                memcpy(&new_args[1], args->items.data(), len * sizeof(node *));
+                return fn->fixed_function(ctx, new_args);
+            }
+        }
+        stack_tuple<STACK_METHOD_ARGS> new_args(len + 1);
+        new_args.items[0] = self;
+        memcpy(&new_args.items[1], args->items.data(), len * sizeof(node *));
+        return method->__call__(ctx, &new_args, kwargs);
+    }
+    tuple *new_args = create_tuple(len + 1);
+    new_args->items[0] = self;
+    memcpy(&new_args->items[1], args->items.data(), len * sizeof(node *));
+    return method->__call__(ctx, new_args, kwargs);
+}
 
 class bound_method : public node {
 private:
@@ -1329,65 +2536,218 @@ public:
     bound_method(node *s, node *f): self(s), function(f) {}
 
     MARK_LIVE_CHILDREN {
-        this->self->mark_live();
+        mark_node_live(this->self);
         this->function->mark_live();
     }
 
     virtual node *__call__(context *ctx, tuple *args, dict *kwargs) {
-        int_t len = args->items.size();
-        tuple *new_args = pc_new(tuple)(len + 1);
-        new_args->items[0] = this->self;
-        for (int_t i = 0; i < len; i++)
-            new_args->items[i+1] = args->items[i];
-        return this->function->__call__(ctx, new_args, kwargs);
+        return call_with_self(ctx, this->function, this->self, args, kwargs);
     }
     virtual node *type() { return &builtin_class_bound_method; }
 };
 
-class function_def : public node {
-private:
-    fptr base_function;
+// All user classes, which are roots: they're set up before the program
+// starts, and their slots are stored without barriers
+static class_def *all_class_defs;
 
+// Abstract base class of user class singleton classes. Class attributes are
+// laid out by shapes too, so inline caches can find methods by slot. These
+// are singletons outside the GC heap, so the slots are too.
+class class_def : public node {
 public:
-    explicit function_def(fptr f): base_function(f) {}
-
-    MARK_LIVE_FN
-
-    virtual bool is_function() { return true; }
-
-    virtual node *__call__(context *ctx, tuple *args, dict *kwargs) {
-        return this->base_function(ctx, args, kwargs);
+    class_def *next_class_def;
+    hidden_class *attr_shape;
+    node_list slots;
+    // Shape of new instances, which has the fields, and whether the fields
+    // came from __slots__, so instances can't have any other attributes
+    hidden_class *instance_shape;
+    uint32_t n_fields;
+    bool fixed_fields;
+
+    class_def(uint32_t n_fields, const char **fields, bool fixed_fields): attr_shape(new hidden_class(NULL)),
+        instance_shape(new hidden_class(this)), n_fields(n_fields), fixed_fields(fixed_fields) {
+        this->next_class_def = all_class_defs;
+        all_class_defs = this;
+        for (uint32_t i = 0; i < n_fields; i++)
+            this->instance_shape = this->instance_shape->add(fields[i]);
     }
-    virtual node *type() { return &builtin_class_function; }
-};
 
-// Abstract base class of user class singleton classes
-class class_def : public node {
-protected:
-    attr_dict attrs;
-
-public:
     virtual void mark_live() {
         // Note that we are a singleton and thus do not mark ourselves live...
-        for (auto it = this->attrs.begin(); it != this->attrs.end(); ++it) {
-            it->second->mark_live();
-        }
+        for (size_t i = 0; i < this->slots.size(); i++)
+            mark_node_live(this->slots[i]);
     }
 
     virtual node *getattr(const char *attr) {
-        return attrs[std::string(attr)];
+        int_t idx = this->attr_shape->find(attr);
+        return idx < 0 ? NULL : this->slots[idx];
     }
     void setattr(const char *attr, node *value) {
-        attrs[std::string(attr)] = value;
+        int_t idx = this->attr_shape->find(attr);
+        if (idx >= 0)
+            this->slots[idx] = value;
+        else {
+            this->attr_shape = this->attr_shape->add(attr);
+            this->slots.push_back(value);
+        }
     }
     virtual void __setattr__(node *key, node *value) {
-        if (!key->is_str())
+        if (!node_ref(key)->is_str())
             error("setattr with non-string");
-        return this->setattr(key->c_str(), value);
+        return this->setattr(node_ref(key)->c_str(), value);
     }
     virtual node *type() { return &builtin_class_type; }
 };
 
+node *object::type() {
+    return this->shape->cls;
+}
+
+node *object::bind(node *value) {
+    if (!is_tagged_int(value) && value->is_function())
+        return pc_new(bound_method)(this, value);
+    return value;
+}
+
+inline object *create_object(class_def *cls) {
+    size_t bytes = sizeof(object) + cls->n_fields * sizeof(node *);
+    return new(alloc.alloc_var_obj(bytes)) object(cls->instance_shape, cls->n_fields);
+}
+
+node *object::getattr(const char *key) {
+    int_t idx = this->shape->find(key);
+    if (idx >= 0 && this->get_slot(idx))
+        return this->get_slot(idx);
+    if (!strcmp(key, "__class__"))
+        return this->shape->cls;
+    node *value = this->shape->cls->getattr(key);
+    if (!value)
+        error("object has no attribute %s", key);
+    return this->bind(value);
+}
+
+void object::setattr(const char *attr, node *value) {
+    int_t idx = this->shape->find(attr);
+    if (idx >= 0)
+        this->set_slot(idx, value);
+    else if (this->shape->cls->fixed_fields)
+        error("'%s' object has no attribute '%s'", this->shape->cls->type_name(), attr);
+    else
+        this->add_slot(this->shape->add(attr), value);
+}
+
+// Cache misses do a full lookup, and remember how it went for this shape. An
+// unset field is looked up in the class, but it could be set in other objects
+// with the shape, so it's only cached as a slot.
+void object::cache_attr(const char *key, attr_cache *cache) {
+    int_t idx = this->shape->find(key);
+    if (idx >= 0)
+        cache->insert({this->shape, this->shape, (uint32_t)idx, ATTR_SLOT});
+    else if ((idx = this->shape->cls->attr_shape->find(key)) >= 0)
+        cache->insert({this->shape, this->shape, (uint32_t)idx, ATTR_CLASS});
+}
+
+node *object::load_attr_miss(node *name, attr_cache *cache) {
+    const char *key = node_ref(name)->c_str();
+    this->cache_attr(key, cache);
+    return this->getattr(key);
+}
+
+void object::store_attr_miss(node *name, node *value, attr_cache *cache) {
+    const char *key = node_ref(name)->c_str();
+    hidden_class *old_shape = this->shape;
+    this->setattr(key, value);
+    cache->insert({old_shape, this->shape, (uint32_t)this->shape->find(key), ATTR_SLOT});
+}
+
+inline node *load_attr(node *obj, node *name, attr_cache *cache) {
+    if (is_tagged_int(obj) || !obj->is_object())
+        return node_ref(obj)->__getattr__(name);
+    object *o = (object *)obj;
+    if (attr_cache_entry *e = cache->find(o->shape)) {
+        if (e->kind == ATTR_CLASS)
+            return o->bind(o->shape->cls->slots[e->index]);
+        if (node *value = o->get_slot(e->index))
+            return value;
+    }
+    return o->load_attr_miss(name, cache);
+}
+
+inline void store_attr(node *obj, node *name, node *value, attr_cache *cache) {
+    if (is_tagged_int(obj) || !obj->is_object()) {
+        node_ref(obj)->__setattr__(name, value);
+        return;
+    }
+    object *o = (object *)obj;
+    if (attr_cache_entry *e = cache->find(o->shape)) {
+        if (e->new_shape == o->shape)
+            o->set_slot(e->index, value);
+        else
+            o->add_slot(e->new_shape, value);
+        return;
+    }
+    o->store_attr_miss(name, value, cache);
+}
+
+// Accesses to fields of self in methods, which the translator gives the
+// field index. These only need to check that self is an instance of the
+// class, and that the field is set, and use the inline cache otherwise.
+inline node *load_field(node *obj, class_def *cls, uint32_t idx, node *name, attr_cache *cache) {
+    if (!is_tagged_int(obj) && obj->is_object() && ((object *)obj)->shape->cls == cls) {
+        if (node *value = ((object *)obj)->fields()[idx])
+            return value;
+    }
+    return load_attr(obj, name, cache);
+}
+
+inline void store_field(node *obj, class_def *cls, uint32_t idx, node *name, node *value, attr_cache *cache) {
+    if (!is_tagged_int(obj) && obj->is_object() && ((object *)obj)->shape->cls == cls) {
+        ((object *)obj)->set_slot(idx, value);
+        return;
+    }
+    store_attr(obj, name, value, cache);
+}
+
+// A function in the class, to be called with the object as self, or NULL if
+// the attribute isn't one of those. This fills in the cache the same way as
+// a load of the attribute would.
+node *object::find_method(node *name, attr_cache *cache) {
+    attr_cache_entry *e = cache->find(this->shape);
+    if (!e) {
+        this->cache_attr(node_ref(name)->c_str(), cache);
+        if (!(e = cache->find(this->shape)))
+            return NULL;
+    }
+    if (e->kind != ATTR_CLASS)
+        return NULL;
+    node *value = this->shape->cls->slots[e->index];
+    return !is_tagged_int(value) && value->is_function() ? value : NULL;
+}
+
+// Calls of obj.attr(...) are split in two, like CPython's LOAD_METHOD and
+// CALL_METHOD, so the method is looked up before the arguments are evaluated.
+// Methods of user classes, and builtin methods found by ID, are called with
+// obj as self directly, so the call doesn't make a bound method. This returns
+// that method, or NULL if there isn't one. Everything but an instance has a
+// builtin class as its type.
+inline node *load_method(node *obj, node *name, method_id id, attr_cache *cache) {
+    if (is_tagged_int(obj))
+        return NULL;
+    if (obj->is_object())
+        return ((object *)obj)->find_method(name, cache);
+    if (id != NO_METHOD_ID)
+        return ((builtin_class *)obj->type())->get_method(id);
+    return NULL;
+}
+
+// Anything else, like a function stored on an object or a module, was loaded
+// as the attribute instead, and is called as usual with NULL for the method.
+inline node *call_method(context *ctx, node *method, node *self, tuple *args, dict *kwargs) {
+    if (method)
+        return call_with_self(ctx, method, self, args, kwargs);
+    return node_ref(self)->__call__(ctx, args, kwargs);
+}
+
 // Abstract base class of module singleton classes
 class module_def : public node {
 public:
@@ -1419,24 +2779,24 @@ LIST_BUILTIN_CLASS_METHODS(BUILTIN_METHOD)
 inline node *bool_init(node *arg) {
     if (!arg)
         return &bool_singleton_False;
-    return create_bool_const(arg->bool_value());
+    return create_bool_const(node_bool_value(arg));
 }
 
 inline node *bytes_init(node *arg) {
     bytes *ret = pc_new(bytes)();
     if (!arg)
         return ret;
-    if (arg->is_int_const()) {
-        int_t value = arg->int_value();
+    if (node_ref(arg)->is_int_const()) {
+        int_t value = node_int_value(arg);
         if (value < 0)
             error("negative count");
         for (int_t i = 0; i < value; i++)
             ret->append(0);
         return ret;
     }
-    node *iter = arg->__iter__();
+    node *iter = node_ref(arg)->__iter__();
     while (node *item = iter->next()) {
-        int_t i = item->int_value();
+        int_t i = node_int_value(item);
         if ((i < 0) || (i >= 256))
             error("invalid byte value");
         ret->append(i);
@@ -1448,47 +2808,56 @@ inline node *dict_init(node *arg) {
     dict *ret = pc_new(dict)();
     if (!arg)
         return ret;
-    node *iter = arg->__iter__();
+    node *iter = node_ref(arg)->__iter__();
     while (node *item = iter->next()) {
-        if (item->len() != 2)
+        if (node_ref(item)->len() != 2)
             error("dictionary update sequence must have length 2");
-        node *key = item->__getitem__(0);
-        node *value = item->__getitem__(1);
+        node *key = node_ref(item)->__getitem__(0);
+        node *value = node_ref(item)->__getitem__(1);
         ret->__setitem__(key, value);
     }
     return ret;
 }
 
 inline node *enumerate_init(node *arg) {
-    node *iter = arg->__iter__();
+    node *iter = node_ref(arg)->__iter__();
     return pc_new(enumerate)(iter);
 }
 
+inline node *frozenset_init(node *arg) {
+    if (arg && !is_tagged_int(arg) && arg->is_frozenset())
+        return arg;
+    frozenset *ret = pc_new(frozenset)();
+    if (arg)
+        ret->update(arg);
+    return ret;
+}
+
 inline node *int_init(node *arg0, node *arg1) {
     if (!arg0)
-        return pc_new(int_const)(0);
-    if (arg0->is_int_const()) {
+        return create_int_const(0);
+    if (node_ref(arg0)->is_int_const()) {
         if (arg1)
             error("int() cannot accept a base when passed an int");
         return arg0;
     }
-    if (arg0->is_bool()) {
+    if (node_ref(arg0)->is_bool()) {
         if (arg1)
             error("int() cannot accept a base when passed a bool");
-        return pc_new(int_const)(arg0->int_value());
+        return create_int_const(node_int_value(arg0));
     }
-    if (arg0->is_str()) {
+    if (node_ref(arg0)->is_str()) {
         int_t base = 10;
         if (arg1) {
-            if (!arg1->is_int_const())
+            if (!node_ref(arg1)->is_int_const())
                 error("base must be an int");
-            base = arg1->int_value();
+            base = node_int_value(arg1);
             if ((base < 0) || (base == 1) || (base > 36))
                 error("base must be 0 or 2-36");
             if (base == 0)
                 error("base 0 unsupported at present");
         }
-        const char *s = arg0->c_str();
+        const char *s = node_ref(arg0)->c_str();
         while (isspace(*s))
             continue;
         int_t sign = 1;
@@ -1516,7 +2885,7 @@ inline node *int_init(node *arg0, node *arg1) {
                 error("digit not valid in base");
             value = value*base + digit;
         }
-        return pc_new(int_const)(sign*value);
+        return create_int_const(sign*value);
     }
     error("don't know how to handle argument to int()");
 }
@@ -1525,21 +2894,21 @@ inline node *list_init(node *arg) {
     list *ret = pc_new(list)();
     if (!arg)
         return ret;
-    node *iter = arg->__iter__();
+    node *iter = node_ref(arg)->__iter__();
     while (node *item = iter->next())
-        ret->items.push_back(item);
+        ret->append(item);
     return ret;
 }
 
 inline node *range_init(node *arg0, node *arg1, node *arg2) {
     int_t start = 0, end, step = 1;
     if (!arg1)
-        end = arg0->int_value();
+        end = node_int_value(arg0);
     else {
-        start = arg0->int_value();
-        end = arg1->int_value();
+        start = node_int_value(arg0);
+        end = node_int_value(arg1);
         if (arg2)
-            step = arg2->int_value();
+            step = node_int_value(arg2);
     }
     return pc_new(range)(start, end, step);
 }
@@ -1549,43 +2918,49 @@ inline node *range_init(node *arg0, node *arg1, node *arg2) {
 // do anything, but the Python docs imply that __len__ and __getitem__ are
 // sufficient.  This seems like a documentation error.
 inline node *reversed_init(node *arg) {
-    int_t len = arg->len();
+    int_t len = node_ref(arg)->len();
     return pc_new(reversed)(arg, len);
 }
 
 inline node *set_init(node *arg) {
     set *ret = pc_new(set)();
-    if (!arg)
-        return ret;
-    node *iter = arg->__iter__();
-    while (node *item = iter->next())
-        ret->add(item);
+    if (arg)
+        ret->update(arg);
     return ret;
 }
 
 inline node *str_init(node *arg) {
     if (!arg)
-        return pc_new(string_const)("");
-    return arg->__str__();
+        return create_string_const("");
+    return node_ref(arg)->__str__();
+}
+
+// Tuples are immutable, so a tuple is returned as is. Anything else is read
+// into a list first, to find the length.
+inline tuple *tuple_from_iter(node *arg) {
+    if (node_ref(arg)->is_tuple())
+        return (tuple *)arg;
+    list *items = (list *)list_init(arg);
+    size_t len = items->items.size();
+    tuple *ret = create_tuple(len);
+    for (size_t i = 0; i < len; i++)
+        ret->items[i] = items->items[i];
+    return ret;
 }
 
 inline node *tuple_init(node *arg) {
-    tuple *ret = pc_new(tuple)();
     if (!arg)
-        return ret;
-    node *iter = arg->__iter__();
-    while (node *item = iter->next())
-        ret->items.push_back(item);
-    return ret;
+        return create_tuple(0);
+    return tuple_from_iter(arg);
 }
 
 inline node *type_init(node *arg) {
-    return arg->type();
+    return node_ref(arg)->type();
 }
 
 inline node *zip_init(node *arg0, node *arg1) {
-    node *iter1 = arg0->__iter__();
-    node *iter2 = arg1->__iter__();
+    node *iter1 = node_ref(arg0)->__iter__();
+    node *iter2 = node_ref(arg1)->__iter__();
     return pc_new(zip)(iter1, iter2);
 }
 
@@ -1600,14 +2975,27 @@ LIST_BUILTIN_CLASSES(DEFINE_GETATTR)
 #undef GET_METHOD
 #undef DEFINE_GETATTR
 
+#define GET_METHOD_BY_ID(class_name, method_name) \
+    case METHOD_ID_##method_name: return &builtin_method_##class_name##_##method_name;
+#define DEFINE_GET_METHOD(class_name) \
+    node *class_name##_class::get_method(method_id id) {  \
+        switch (id) { \
+        LIST_##class_name##_CLASS_METHODS(GET_METHOD_BY_ID) \
+        default: return NULL; \
+        } \
+    }
+LIST_BUILTIN_CLASSES(DEFINE_GET_METHOD)
+#undef GET_METHOD_BY_ID
+#undef DEFINE_GET_METHOD
+
 node *node::__contains__(node *rhs) {
     return create_bool_const(this->contains(rhs));
 }
 
 node *node::__getattr__(node *key) {
-    if (!key->is_str())
+    if (!node_ref(key)->is_str())
         error("getattr with non-string");
-    return this->getattr(key->c_str());
+    return this->getattr(node_ref(key)->c_str());
 }
 
 node *node::getattr(const char *key) {
@@ -1617,11 +3005,23 @@ node *node::getattr(const char *key) {
 }
 
 node *node::__hash__() {
-    return pc_new(int_const)(this->hash());
+    return create_int_const(this->hash());
 }
 
 node *node::__len__() {
-    return pc_new(int_const)(this->len());
+    return create_int_const(this->len());
+}
+
+// Get the next item and unpack it into n values, for loops like "for a, b in
+// x". The item can't escape, so iterators that make a tuple for each item
+// override this to store the values directly.
+bool node::next_unpack(int_t n, node **items) {
+    node *item = this->next();
+    if (!item)
+        return false;
+    for (int_t i = 0; i < n; i++)
+        items[i] = node_ref(item)->__getitem__(tag_int(i));
+    return true;
 }
 
 node *node::__ncontains__(node *rhs) {
@@ -1641,11 +3041,11 @@ node *node::__isnot__(node *rhs) {
 }
 
 node *node::__repr__() {
-    return pc_new(string_const)(this->repr());
+    return create_string_const(this->repr());
 }
 
 node *node::__str__() {
-    return pc_new(string_const)(this->str());
+    return create_string_const(this->str());
 }
 
 std::string node::repr() {
@@ -1657,7 +3057,7 @@ std::string node::repr() {
 // Don't call node::getattr as a fallback -- this will result in infinite recursion
 node *builtin_class::getattr(const char *key) {
     if (!strcmp(key, "__name__"))
-        return pc_new(string_const)(this->type_name());
+        return create_string_const(this->type_name());
     if (!strcmp(key, "__class__"))
         return type();
     error("%s has no attribute %s", type_name(), key);
@@ -1667,6 +3067,14 @@ bool none_const::_eq(node *rhs) {
     return (this == rhs);
 }
 
+// Tagged ints only get a temporary int_const, so make sure a bound method
+// holds onto the real value rather than the temporary.
+node *int_const::getattr(const char *key) {
+    if (!strcmp(key, "__class__"))
+        return type();
+    return pc_new(bound_method)(create_int_const(this->value), type()->getattr(key));
+}
+
 std::string int_const::repr() {
     char buf[32];
     sprintf(buf, "%" I64_FMT, this->value);
@@ -1678,12 +3086,13 @@ std::string bool_const::repr() {
 }
 
 node *list::__add__(node *rhs_arg) {
-    if (!rhs_arg->is_list())
+    if (!node_ref(rhs_arg)->is_list())
         error("list add error");
     list *rhs = (list *)rhs_arg;
     int_t self_len = this->items.size();
     int_t rhs_len = rhs->items.size();
     list *ret = pc_new(list)(self_len + rhs_len);
+    ret->strategy = join_strategies(this->strategy, rhs->strategy);
     for (int_t i = 0; i < self_len; i++)
         ret->items[i] = this->items[i];
     for (int_t i = 0; i < rhs_len; i++)
@@ -1692,13 +3101,14 @@ node *list::__add__(node *rhs_arg) {
 }
 
 node *list::__mul__(node *rhs_arg) {
-    if (!rhs_arg->is_int_const())
+    if (!node_ref(rhs_arg)->is_int_const())
         error("list mul error");
-    int_t rhs = ((int_const *)rhs_arg)->value;
+    int_t rhs = node_int_value(rhs_arg);
     if (rhs <= 0)
         return pc_new(list)();
     int_t self_len = this->items.size();
     list *ret = pc_new(list)(self_len * rhs);
+    ret->strategy = this->strategy;
     node **items = &ret->items[0];
     do {
         for (int_t i = 0; i < self_len; i++)
@@ -1708,35 +3118,37 @@ node *list::__mul__(node *rhs_arg) {
 }
 
 node *list::__iadd__(node *rhs_arg) {
-    if (!rhs_arg->is_list())
+    if (!node_ref(rhs_arg)->is_list())
         error("list add error");
     list *rhs = (list *)rhs_arg;
     for (auto it = rhs->items.begin(); it != rhs->items.end(); ++it)
-        this->items.push_back(*it);
+        this->append(*it);
     return this;
 }
 
 node *list::__imul__(node *rhs) {
-    if (!rhs->is_int_const())
+    if (!node_ref(rhs)->is_int_const())
         error("list mul error");
     int_t len = this->items.size();
-    for (int_t x = rhs->int_value() - 1; x > 0; x--) {
+    for (int_t x = node_int_value(rhs) - 1; x > 0; x--) {
         for (int_t i = 0; i < len; i++)
-            this->items.push_back(this->items[i]);
+            this->append(this->items[i]);
     }
     return this;
 }
 
 bool list::_eq(node *rhs_arg) {
-    if (!rhs_arg->is_list())
+    if (!node_ref(rhs_arg)->is_list())
         return false;
     list *rhs = (list *)rhs_arg;
     int_t len = this->items.size();
     int_t rhs_len = rhs->items.size();
     if (len != rhs_len)
         return false;
+    if (this->strategy == LIST_INTS && rhs->strategy == LIST_INTS)
+        return !memcmp(this->items.data(), rhs->items.data(), len * sizeof(node *));
     for (int_t i = 0; i < len; i++) {
-        if (!this->items[i]->_eq(rhs->items[i]))
+        if (!node_ref(this->items[i])->_eq(rhs->items[i]))
             return false;
     }
     return true;
@@ -1747,12 +3159,12 @@ node *dict::__iter__() {
 }
 
 node *tuple::__add__(node *rhs_arg) {
-    if (!rhs_arg->is_tuple())
+    if (!node_ref(rhs_arg)->is_tuple())
         error("tuple add error");
     tuple *rhs = (tuple *)rhs_arg;
     int_t self_len = this->items.size();
     int_t rhs_len = rhs->items.size();
-    tuple *ret = pc_new(tuple)(self_len + rhs_len);
+    tuple *ret = create_tuple(self_len + rhs_len);
     for (int_t i = 0; i < self_len; i++)
         ret->items[i] = this->items[i];
     for (int_t i = 0; i < rhs_len; i++)
@@ -1761,13 +3173,13 @@ node *tuple::__add__(node *rhs_arg) {
 }
 
 node *tuple::__mul__(node *rhs_arg) {
-    if (!rhs_arg->is_int_const())
+    if (!node_ref(rhs_arg)->is_int_const())
         error("tuple mul error");
-    int_t rhs = ((int_const *)rhs_arg)->value;
+    int_t rhs = node_int_value(rhs_arg);
     if (rhs <= 0)
-        return pc_new(tuple)();
+        return create_tuple(0);
     int_t self_len = this->items.size();
-    tuple *ret = pc_new(tuple)(self_len * rhs);
+    tuple *ret = create_tuple(self_len * rhs);
     node **items = &ret->items[0];
     do {
         for (int_t i = 0; i < self_len; i++)
@@ -1777,7 +3189,7 @@ node *tuple::__mul__(node *rhs_arg) {
 }
 
 bool tuple::_eq(node *rhs_arg) {
-    if (!rhs_arg->is_tuple())
+    if (!node_ref(rhs_arg)->is_tuple())
         return false;
     tuple *rhs = (tuple *)rhs_arg;
     int_t len = this->items.size();
@@ -1785,73 +3197,206 @@ bool tuple::_eq(node *rhs_arg) {
     if (len != rhs_len)
         return false;
     for (int_t i = 0; i < len; i++) {
-        if (!this->items[i]->_eq(rhs->items[i]))
+        if (!node_ref(this->items[i])->_eq(rhs->items[i]))
             return false;
     }
     return true;
 }
 
-node *set::__or__(node *rhs_arg) {
-    if (!rhs_arg->is_set())
+set *set::new_like(size_t n) {
+    set *ret = this->is_frozenset() ? pc_new(frozenset)() : pc_new(set)();
+    ret->reserve(n);
+    return ret;
+}
+
+void set::update(node *iterable) {
+    if (is_set_like(iterable)) {
+        set *other = (set *)iterable;
+        this->reserve(this->used + other->used);
+        for (size_t i = 0; i < other->slots.size(); i++) {
+            if (other->ctrl[i] >= 0) {
+                set_entry &e = other->slots[i];
+                if (this->find(e.key, e.hash) < 0)
+                    this->insert_new(e.hash, e.key);
+            }
+        }
+        return;
+    }
+    node *iter = node_ref(iterable)->__iter__();
+    while (node *item = iter->next())
+        this->add(item);
+}
+
+bool set::issubset(set *other) {
+    if (this->used > other->used)
+        return false;
+    for (size_t i = 0; i < this->slots.size(); i++) {
+        if (this->ctrl[i] >= 0) {
+            set_entry &e = this->slots[i];
+            if (other->find(e.key, e.hash) < 0)
+                return false;
+        }
+    }
+    return true;
+}
+
+bool set::isdisjoint(set *other) {
+    set *small = this, *large = other;
+    if (small->used > large->used)
+        std::swap(small, large);
+    for (size_t i = 0; i < small->slots.size(); i++) {
+        if (small->ctrl[i] >= 0) {
+            set_entry &e = small->slots[i];
+            if (large->find(e.key, e.hash) >= 0)
+                return false;
+        }
+    }
+    return true;
+}
+
+void set::intersection_update(set *other) {
+    this->take((set *)this->__and__(other));
+}
+
+void set::symmetric_difference_update(set *other) {
+    if (other == this) {
+        this->clear();
+        return;
+    }
+    this->reserve(this->used + other->used);
+    for (size_t i = 0; i < other->slots.size(); i++) {
+        if (other->ctrl[i] >= 0) {
+            set_entry &e = other->slots[i];
+            int_t j = this->find(e.key, e.hash);
+            if (j >= 0)
+                this->erase(j);
+            else
+                this->insert_new(e.hash, e.key);
+        }
+    }
+}
+
+node *set::__and__(node *rhs) {
+    if (!is_set_like(rhs))
+        error("set and error");
+    set *small = this, *large = (set *)rhs;
+    if (small->used > large->used)
+        std::swap(small, large);
+    set *ret = this->new_like(small->used);
+    for (size_t i = 0; i < small->slots.size(); i++) {
+        if (small->ctrl[i] >= 0) {
+            set_entry &e = small->slots[i];
+            if (large->find(e.key, e.hash) >= 0)
+                ret->insert_new(e.hash, e.key);
+        }
+    }
+    return ret;
+}
+
+node *set::__iand__(node *rhs) {
+    if (!is_set_like(rhs))
+        error("set and error");
+    this->intersection_update((set *)rhs);
+    return this;
+}
+
+node *set::__or__(node *rhs) {
+    if (!is_set_like(rhs))
         error("set or error");
-    set *rhs = (set *)rhs_arg;
-    set *ret = this->copy();
-    for (auto it = rhs->items.begin(); it != rhs->items.end(); ++it)
-        ret->add(it->second);
+    set *other = (set *)rhs;
+    set *ret = this->new_like(this->used + other->used);
+    ret->update(this);
+    ret->update(other);
     return ret;
 }
 
-node *set::__ior__(node *rhs_arg) {
-    if (!rhs_arg->is_set())
+node *set::__ior__(node *rhs) {
+    if (!is_set_like(rhs))
         error("set or error");
-    set *rhs = (set *)rhs_arg;
-    for (auto it = rhs->items.begin(); it != rhs->items.end(); ++it)
-        this->add(it->second);
+    this->update(rhs);
     return this;
 }
 
-node *set::__sub__(node *rhs_arg) {
-    if (!rhs_arg->is_set())
+node *set::__sub__(node *rhs) {
+    if (!is_set_like(rhs))
         error("set sub error");
-    set *rhs = (set *)rhs_arg;
-    set *ret = this->copy();
-    for (auto it = rhs->items.begin(); it != rhs->items.end(); ++it)
-        ret->discard(it->second);
+    set *other = (set *)rhs;
+    set *ret = this->new_like(this->used);
+    for (size_t i = 0; i < this->slots.size(); i++) {
+        if (this->ctrl[i] >= 0) {
+            set_entry &e = this->slots[i];
+            if (other->find(e.key, e.hash) < 0)
+                ret->insert_new(e.hash, e.key);
+        }
+    }
     return ret;
 }
 
-node *set::__isub__(node *rhs_arg) {
-    if (!rhs_arg->is_set())
+node *set::__isub__(node *rhs) {
+    if (!is_set_like(rhs))
         error("set sub error");
-    set *rhs = (set *)rhs_arg;
-    for (auto it = rhs->items.begin(); it != rhs->items.end(); ++it)
-        this->discard(it->second);
+    set *other = (set *)rhs;
+    if (other == this) {
+        this->clear();
+        return this;
+    }
+    for (size_t i = 0; i < other->slots.size(); i++) {
+        if (other->ctrl[i] >= 0) {
+            set_entry &e = other->slots[i];
+            int_t j = this->find(e.key, e.hash);
+            if (j >= 0)
+                this->erase(j);
+        }
+    }
     return this;
 }
 
-bool set::_eq(node *rhs_arg) {
-    if (!rhs_arg->is_set())
-        return false;
-    set *rhs = (set *)rhs_arg;
-    int_t len = this->items.size();
-    int_t rhs_len = rhs->items.size();
-    if (len != rhs_len)
+node *set::__xor__(node *rhs) {
+    if (!is_set_like(rhs))
+        error("set xor error");
+    set *other = (set *)rhs;
+    set *small = this, *large = other;
+    if (small->used > large->used)
+        std::swap(small, large);
+    set *ret = this->new_like(this->used + other->used);
+    ret->update(large);
+    ret->symmetric_difference_update(small);
+    return ret;
+}
+
+node *set::__ixor__(node *rhs) {
+    if (!is_set_like(rhs))
+        error("set xor error");
+    this->symmetric_difference_update((set *)rhs);
+    return this;
+}
+
+bool set::_eq(node *rhs) {
+    if (!is_set_like(rhs))
         return false;
-    for (auto it = this->items.begin(), it2 = rhs->items.begin(); it != this->items.end(); ++it, ++it2) {
-        if (it->first != it2->first)
-            return false;
-        if (!it->second->_eq(it2->second))
-            return false;
-    }
-    return true;
+    set *other = (set *)rhs;
+    return this->used == other->used && this->issubset(other);
 }
 
+#define SET_CMP_OP(NAME, EXPR) \
+    bool set::_##NAME(node *rhs) { \
+        if (!is_set_like(rhs)) \
+            error(#NAME " unimplemented for set"); \
+        set *other = (set *)rhs; \
+        return EXPR; \
+    }
+SET_CMP_OP(le, this->issubset(other))
+SET_CMP_OP(lt, this->used < other->used && this->issubset(other))
+SET_CMP_OP(ge, other->issubset(this))
+SET_CMP_OP(gt, other->used < this->used && other->issubset(this))
+#undef SET_CMP_OP
+
 // This entire function is very stupidly implemented.
 node *string_const::__mod__(node *rhs_arg) {
     std::ostringstream new_string;
     int_t rhs_len;
     node **rhs_items;
-    if (rhs_arg->is_tuple()) {
+    if (node_ref(rhs_arg)->is_tuple()) {
         tuple *rhs = (tuple *)rhs_arg;
         rhs_len = rhs->items.size();
         rhs_items = &rhs->items[0];
@@ -1861,7 +3406,7 @@ node *string_const::__mod__(node *rhs_arg) {
         rhs_items = &rhs_arg;
     }
     int_t args = 0;
-    for (const char *c = value.c_str(); *c; c++) {
+    for (const char *c = this->c_str(); *c; c++) {
         if (*c == '%') {
             char fmt_buf[64], buf[64];
             char *fmt = fmt_buf;
@@ -1880,7 +3425,7 @@ node *string_const::__mod__(node *rhs_arg) {
                 // HACK. all of this.
                 if (fmt != fmt_buf + 1)
                     error("format specifiers not allowed on strings for now");
-                new_string << arg->str();
+                new_string << node_ref(arg)->str();
                 continue;
             }
             else if (*c == 'd' || *c == 'i' || *c == 'X') {
@@ -1888,42 +3433,42 @@ node *string_const::__mod__(node *rhs_arg) {
                 *fmt++ = 'l';
                 *fmt++ = *c;
                 *fmt = 0;
-                sprintf(buf, fmt_buf, arg->int_value());
+                sprintf(buf, fmt_buf, node_int_value(arg));
             }
             else if (*c == 'c') {
                 *fmt++ = 'c';
                 *fmt = 0;
                 int_t char_value;
-                if (arg->is_str())
-                    char_value = (unsigned char)arg->c_str()[0];
+                if (node_ref(arg)->is_str())
+                    char_value = (unsigned char)node_ref(arg)->c_str()[0];
                 else
-                    char_value = arg->int_value();
+                    char_value = node_int_value(arg);
                 sprintf(buf, fmt_buf, char_value);
             }
             else
-                error("bad format specifier '%c' in \"%s\"", *c, value.c_str());
+                error("bad format specifier '%c' in \"%s\"", *c, this->c_str());
             new_string << buf;
         }
         else
             new_string << *c;
     }
-    return pc_new(string_const)(new_string.str());
+    return create_string_const(new_string.str());
 }
 
 node *string_const::__add__(node *rhs) {
-    if (!rhs->is_str())
+    if (!node_ref(rhs)->is_str())
         error("bad argument to str.add");
-    std::string new_string = this->value + rhs->str_value();
-    return pc_new(string_const)(new_string);
+    std::string new_string = this->str_value() + node_ref(rhs)->str_value();
+    return create_string_const(new_string);
 }
 
 node *string_const::__mul__(node *rhs) {
-    if (!rhs->is_int_const() || rhs->int_value() < 0)
+    if (!node_ref(rhs)->is_int_const() || node_int_value(rhs) < 0)
         error("bad argument to str.mul");
     std::string new_string;
-    for (int_t i = 0; i < rhs->int_value(); i++)
-        new_string += this->value;
-    return pc_new(string_const)(new_string);
+    for (int_t i = 0; i < node_int_value(rhs); i++)
+        new_string.append(this->begin(), this->length());
+    return create_string_const(new_string);
 }
 
 node *file::getattr(const char *key) {
@@ -1938,6 +3483,104 @@ node *builtin_class::type() {
     return &builtin_class_type;
 }
 
+// Operators called from generated code. When the operands are tagged ints, the
+// operation is done inline, without any virtual calls or allocation. Other
+// common types are dispatched on the type tag of the left operand, calling the
+// method directly so it can be inlined. Subclasses that share a tag with one
+// of these classes mustn't override their operators.
+#define TAG_DISPATCH(lhs, CALL) \
+    if (!is_tagged_int(lhs)) { \
+        switch (lhs->tag) { \
+        case TAG_INT: return ((int_const *)lhs)->int_const::CALL; \
+        case TAG_BOOL: return ((bool_const *)lhs)->bool_const::CALL; \
+        case TAG_STR: return ((string_const *)lhs)->string_const::CALL; \
+        case TAG_LIST: return ((list *)lhs)->list::CALL; \
+        case TAG_TUPLE: return ((tuple *)lhs)->tuple::CALL; \
+        default: return lhs->CALL; \
+        } \
+    } \
+    return node_ref(lhs)->CALL;
+
+#define INT_BINOP(NAME, OP) \
+    inline node *binop_##NAME(node *lhs, node *rhs) { \
+        if (is_tagged_int(lhs) && is_tagged_int(rhs)) \
+            return create_int_const(tagged_int_value(lhs) OP tagged_int_value(rhs)); \
+        TAG_DISPATCH(lhs, __##NAME##__(rhs)) \
+    } \
+    inline node *binop_i##NAME(node *lhs, node *rhs) { \
+        if (is_tagged_int(lhs) && is_tagged_int(rhs)) \
+            return create_int_const(tagged_int_value(lhs) OP tagged_int_value(rhs)); \
+        TAG_DISPATCH(lhs, __i##NAME##__(rhs)) \
+    }
+INT_BINOP(add, +)
+INT_BINOP(and, &)
+INT_BINOP(floordiv, /)
+INT_BINOP(lshift, <<)
+INT_BINOP(mod, %)
+INT_BINOP(mul, *)
+INT_BINOP(or, |)
+INT_BINOP(rshift, >>)
+INT_BINOP(sub, -)
+INT_BINOP(xor, ^)
+#undef INT_BINOP
+
+// The tagged representation preserves ordering, so no need to untag
+#define INT_CMPOP(NAME, OP) \
+    inline bool cmpop_##NAME(node *lhs, node *rhs) { \
+        TAG_DISPATCH(lhs, _##NAME(rhs)) \
+    } \
+    inline node *binop_##NAME(node *lhs, node *rhs) { \
+        if (is_tagged_int(lhs) && is_tagged_int(rhs)) \
+            return create_bool_const((intptr_t)lhs OP (intptr_t)rhs); \
+        return create_bool_const(cmpop_##NAME(lhs, rhs)); \
+    }
+INT_CMPOP(eq, ==)
+INT_CMPOP(ne, !=)
+INT_CMPOP(lt, <)
+INT_CMPOP(le, <=)
+INT_CMPOP(gt, >)
+INT_CMPOP(ge, >=)
+#undef INT_CMPOP
+#undef TAG_DISPATCH
+
+// Python's ordering for sequences: the first pair of items that differ
+// decides, and otherwise the shorter sequence is smaller.
+static bool sequence_lt(node **lhs, size_t lhs_len, node **rhs, size_t rhs_len) {
+    size_t len = std::min(lhs_len, rhs_len);
+    for (size_t i = 0; i < len; i++) {
+        if (!nodes_equal(lhs[i], rhs[i]))
+            return cmpop_lt(lhs[i], rhs[i]);
+    }
+    return lhs_len < rhs_len;
+}
+
+#define TUPLE_CMP_OP(NAME, EXPR) \
+    bool tuple::_##NAME(node *rhs_arg) { \
+        if (!node_ref(rhs_arg)->is_tuple()) \
+            error(#NAME " unimplemented for tuple"); \
+        tuple *rhs = (tuple *)rhs_arg; \
+        node **a = this->items.data(), **b = rhs->items.data(); \
+        size_t a_len = this->items.size(), b_len = rhs->items.size(); \
+        return EXPR; \
+    }
+TUPLE_CMP_OP(lt, sequence_lt(a, a_len, b, b_len))
+TUPLE_CMP_OP(le, !sequence_lt(b, b_len, a, a_len))
+TUPLE_CMP_OP(gt, sequence_lt(b, b_len, a, a_len))
+TUPLE_CMP_OP(ge, !sequence_lt(a, a_len, b, b_len))
+#undef TUPLE_CMP_OP
+
+inline node *binop_is(node *lhs, node *rhs) {
+    return create_bool_const(lhs == rhs);
+}
+
+inline node *binop_isnot(node *lhs, node *rhs) {
+    return create_bool_const(lhs != rhs);
+}
+
+inline node *unop_not(node *rhs) {
+    return create_bool_const(!node_bool_value(rhs));
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // Builtins ////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
@@ -1950,6 +3593,10 @@ public:
     builtin_function_def(const char *name, fptr base_function): function_def(base_function) {
         this->name = name;
     }
+    builtin_function_def(const char *name, fptr base_function, const function_info *info):
+        function_def(base_function, info) {
+        this->name = name;
+    }
 
     MARK_LIVE_SINGLETON_FN
 
@@ -1960,22 +3607,22 @@ public:
 };
 
 inline node *builtin_abs(node *arg) {
-    return arg->__abs__();
+    return node_ref(arg)->__abs__();
 }
 
 inline node *builtin_chr(node *arg) {
-    if (!arg->is_int_const())
+    if (!node_ref(arg)->is_int_const())
         error("bad arguments to chr()");
-    int_t i = arg->int_value();
+    int_t i = node_int_value(arg);
     if (i < 0 || i > 255)
         error("bad arguments to chr()");
     std::string s;
     s += (char)i;
-    return pc_new(string_const)(s);
+    return create_string_const(s);
 }
 
 inline node *builtin_dict_clear(dict *self) {
-    self->items.clear();
+    self->clear();
     return &none_singleton;
 }
 
@@ -2003,92 +3650,89 @@ inline node *builtin_dict_values(dict *self) {
 }
 
 inline node *builtin_file_read(file *self, node *arg) {
-    if (!arg->is_int_const())
+    if (!node_ref(arg)->is_int_const())
         error("bad arguments to file.read()");
-    return self->read(arg->int_value());
+    return self->read(node_int_value(arg));
 }
 
 inline node *builtin_file_write(file *self, node *arg) {
-    if (!arg->is_str())
+    if (!node_ref(arg)->is_str())
         error("bad arguments to file.write()");
     self->write((string_const *)arg);
     return &none_singleton;
 }
 
 inline node *builtin_isinstance(node *arg0, node *arg1) {
-    node *obj_class = arg0->type();
+    node *obj_class = node_ref(arg0)->type();
     return create_bool_const(obj_class == arg1);
 }
 
 inline node *builtin_iter(node *arg) {
-    return arg->__iter__();
+    return node_ref(arg)->__iter__();
 }
 
 inline node *builtin_len(node *arg) {
-    return arg->__len__();
+    return node_ref(arg)->__len__();
 }
 
 inline node *builtin_list_append(list *self, node *arg) {
-    self->items.push_back(arg);
+    self->append(arg);
     return &none_singleton;
 }
 
 inline node *builtin_list_count(list *self, node *arg) {
     int_t n = 0;
-    int_t len = self->items.size();
-    for (int_t i = 0; i < len; i++) {
-        if (self->items[i]->_eq(arg))
-            n++;
-    }
-    return pc_new(int_const)(n);
+    for (int_t i = self->find(arg); i >= 0; i = self->find(arg, i + 1))
+        n++;
+    return create_int_const(n);
 }
 
 inline node *builtin_list_extend(list *self, node *arg) {
-    node *iter = arg->__iter__();
+    node *iter = node_ref(arg)->__iter__();
     while (node *item = iter->next())
-        self->items.push_back(item);
+        self->append(item);
     return &none_singleton;
 }
 
 inline node *builtin_list_index(list *self, node *arg) {
-    int_t len = self->items.size();
-    for (int_t i = 0; i < len; i++) {
-        if (self->items[i]->_eq(arg))
-            return pc_new(int_const)(i);
-    }
-    error("item not found in list");
+    int_t i = self->find(arg);
+    if (i < 0)
+        error("item not found in list");
+    return create_int_const(i);
 }
 
 inline node *builtin_list_insert(list *self, node *arg0_arg, node *arg1) {
-    if (!arg0_arg->is_int_const())
+    if (!node_ref(arg0_arg)->is_int_const())
         error("bad argument to list.insert()");
-    int_t arg0 = arg0_arg->int_value();
+    int_t arg0 = node_int_value(arg0_arg);
     int_t len = self->items.size();
     if ((arg0 < 0) || (arg0 > len))
         error("bad argument to list.insert()");
+    if (self->items.full())
+        gc_write_barrier(self);
+    else
+        gc_write_barrier(self, arg1);
+    self->note_item(arg1);
     self->items.insert(self->items.begin() + arg0, arg1);
     return &none_singleton;
 }
 
 inline node *builtin_list_pop(node *self_arg, node *arg) {
-    if (!self_arg->is_list())
+    if (!node_ref(self_arg)->is_list())
         error("bad argument to list.pop()");
     list *self = (list *)self_arg;
-    if (arg && !arg->is_int_const())
+    if (arg && !node_ref(arg)->is_int_const())
         error("bad argument to list.pop()");
-    int_t idx = arg ? arg->int_value() : -1;
+    int_t idx = arg ? node_int_value(arg) : -1;
     return self->pop(idx);
 }
 
 inline node *builtin_list_remove(list *self, node *arg) {
-    int_t len = self->items.size();
-    for (int_t i = 0; i < len; i++) {
-        if (self->items[i]->_eq(arg)) {
-            self->items.erase(self->items.begin() + i);
-            return &none_singleton;
-        }
-    }
-    error("item not found in list");
+    int_t i = self->find(arg);
+    if (i < 0)
+        error("item not found in list");
+    self->items.erase(self->items.begin() + i);
+    return &none_singleton;
 }
 
 inline node *builtin_list_reverse(list *self) {
@@ -2103,52 +3747,190 @@ inline node *builtin_list_reverse(list *self) {
 }
 
 static bool compare_nodes(node *lhs, node *rhs) {
-    return lhs->_lt(rhs);
+    return node_ref(lhs)->_lt(rhs);
+}
+// Tagging keeps the order of ints, and equal ints can't be told apart, so
+// these don't need a stable sort.
+static bool compare_tagged_ints(node *lhs, node *rhs) {
+    return (intptr_t)lhs < (intptr_t)rhs;
+}
+static bool compare_strs(node *lhs, node *rhs) {
+    return ((string_const *)lhs)->compare((string_const *)rhs) < 0;
+}
+// Tuples of tagged ints, such as records of (score, id)
+static bool compare_int_tuples(node *lhs_arg, node *rhs_arg) {
+    tuple *lhs = (tuple *)lhs_arg, *rhs = (tuple *)rhs_arg;
+    size_t lhs_len = lhs->items.size(), rhs_len = rhs->items.size();
+    size_t len = std::min(lhs_len, rhs_len);
+    for (size_t i = 0; i < len; i++) {
+        if (lhs->items[i] != rhs->items[i])
+            return (intptr_t)lhs->items[i] < (intptr_t)rhs->items[i];
+    }
+    return lhs_len < rhs_len;
+}
+
+typedef bool (*compare_fn)(node *lhs, node *rhs);
+
+// Pick the cheapest comparison that works for all of a list's items
+static compare_fn list_compare_fn(list *l) {
+    if (l->strategy == LIST_INTS)
+        return compare_tagged_ints;
+    if (l->strategy == LIST_STRS)
+        return compare_strs;
+    if (l->strategy == LIST_EMPTY)
+        return compare_nodes;
+    for (auto it = l->items.begin(); it != l->items.end(); ++it) {
+        if (is_tagged_int(*it) || !(*it)->is_tuple())
+            return compare_nodes;
+        tuple *t = (tuple *)*it;
+        for (auto it2 = t->items.begin(); it2 != t->items.end(); ++it2)
+            if (!is_tagged_int(*it2))
+                return compare_nodes;
+    }
+    return compare_int_tuples;
+}
+
+struct sort_item {
+    node *key;
+    node *value;
+};
+template<compare_fn LESS>
+static bool compare_sort_items(const sort_item &lhs, const sort_item &rhs) {
+    return LESS(lhs.key, rhs.key);
+}
+
+// Python's sort is stable even when reversed, so reverse the list around a
+// stable sort. With a key function, the keys are computed once each, into
+// a list of their own so they get a specialized comparison too, and sorted
+// along with the items.
+void list::sort(context *ctx, node *key, bool reverse) {
+    if (reverse)
+        std::reverse(this->items.begin(), this->items.end());
+    if (!key) {
+        compare_fn less = list_compare_fn(this);
+        if (less == compare_tagged_ints)
+            std::sort(this->items.begin(), this->items.end(), compare_tagged_ints);
+        else
+            std::stable_sort(this->items.begin(), this->items.end(), less);
+    }
+    else {
+        // The items are moved out while the keys are computed, so the list
+        // looks empty to the key function, as in CPython, and any change it
+        // makes is caught. The key function can collect garbage, so root the
+        // items and the keys, and the function too, since it might only be
+        // referenced by the caller's keyword arguments.
+        list *values = pc_new(list)();
+        std::swap(values->items, this->items);
+        values->strategy = this->strategy;
+        node *roots[4] = {this, key, values, NULL};
+        context frame(ctx, 0, NULL, 4, roots);
+        size_t len = values->items.size();
+        list *keys = pc_new(list)();
+        roots[3] = keys;
+        for (size_t i = 0; i < len; i++) {
+            stack_tuple<1> args;
+            args.items[0] = values->items[i];
+            keys->append(node_ref(key)->__call__(&frame, &args, NULL));
+        }
+        // Like CPython, check for storage too, in case items were added and
+        // removed again
+        if (this->items.data())
+            error("list modified during sort");
+
+        std::vector<sort_item> sort_items(len);
+        for (size_t i = 0; i < len; i++)
+            sort_items[i] = {keys->items[i], values->items[i]};
+        compare_fn less = list_compare_fn(keys);
+        if (less == compare_tagged_ints)
+            std::stable_sort(sort_items.begin(), sort_items.end(), compare_sort_items<compare_tagged_ints>);
+        else if (less == compare_strs)
+            std::stable_sort(sort_items.begin(), sort_items.end(), compare_sort_items<compare_strs>);
+        else if (less == compare_int_tuples)
+            std::stable_sort(sort_items.begin(), sort_items.end(), compare_sort_items<compare_int_tuples>);
+        else
+            std::stable_sort(sort_items.begin(), sort_items.end(), compare_sort_items<compare_nodes>);
+        for (size_t i = 0; i < len; i++)
+            values->items[i] = sort_items[i].value;
+        // The list gets its storage back, which may be younger than it is
+        std::swap(values->items, this->items);
+        gc_write_barrier(this);
+    }
+    if (reverse)
+        std::reverse(this->items.begin(), this->items.end());
 }
 
-inline node *builtin_list_sort(list *self) {
-    std::stable_sort(self->items.begin(), self->items.end(), compare_nodes);
+inline node *builtin_list_sort(context *ctx, list *self, node *key, node *reverse) {
+    if (key == &none_singleton)
+        key = NULL;
+    self->sort(ctx, key, reverse && node_bool_value(reverse));
     return &none_singleton;
 }
 
 inline node *builtin_max(node *arg) {
-    node *iter = arg->__iter__();
+    node *iter = node_ref(arg)->__iter__();
     node *ret = iter->next();
     if (!ret)
         error("max() expects non-empty iterable");
     while (node *item = iter->next()) {
-        if (item->_gt(ret))
+        if (node_ref(item)->_gt(ret))
             ret = item;
     }
     return ret;
 }
 
 inline node *builtin_min(node *arg) {
-    node *iter = arg->__iter__();
+    node *iter = node_ref(arg)->__iter__();
     node *ret = iter->next();
     if (!ret)
         error("min() expects non-empty iterable");
     while (node *item = iter->next()) {
-        if (item->_lt(ret))
+        if (node_ref(item)->_lt(ret))
             ret = item;
     }
     return ret;
 }
 
 inline node *builtin_open(node *arg0, node *arg1) {
-    if (!arg0->is_str() || !arg1->is_str())
+    if (!node_ref(arg0)->is_str() || !node_ref(arg1)->is_str())
         error("bad arguments to open()");
-    return pc_new(file)(arg0->c_str(), arg1->c_str());
+    return pc_new(file)(node_ref(arg0)->c_str(), node_ref(arg1)->c_str());
 }
 
 inline node *builtin_ord(node *arg) {
-    if (!arg->is_str() || arg->len() != 1)
+    if (!node_ref(arg)->is_str() || node_ref(arg)->len() != 1)
         error("bad arguments to ord()");
-    return pc_new(int_const)((unsigned char)arg->c_str()[0]);
+    return create_int_const((unsigned char)node_ref(arg)->c_str()[0]);
 }
 
 inline node *builtin_repr(node *arg) {
-    return arg->__repr__();
+    return node_ref(arg)->__repr__();
+}
+
+// Set operations take any iterable, but work on sets
+inline set *set_arg(node *arg) {
+    if (is_set_like(arg))
+        return (set *)arg;
+    return (set *)set_init(arg);
+}
+
+inline node *builtin_frozenset_copy(frozenset *self) {
+    return self;
+}
+
+inline node *builtin_frozenset_isdisjoint(frozenset *self, node *arg) {
+    return create_bool_const(self->isdisjoint(set_arg(arg)));
+}
+
+inline node *builtin_frozenset_issubset(frozenset *self, node *arg) {
+    return create_bool_const(self->issubset(set_arg(arg)));
+}
+
+inline node *builtin_frozenset_issuperset(frozenset *self, node *arg) {
+    return create_bool_const(set_arg(arg)->issubset(self));
+}
+
+inline node *builtin_frozenset_symmetric_difference(frozenset *self, node *arg) {
+    return self->__xor__(set_arg(arg));
 }
 
 inline node *builtin_set_add(set *self, node *arg) {
@@ -2157,7 +3939,7 @@ inline node *builtin_set_add(set *self, node *arg) {
 }
 
 inline node *builtin_set_clear(set *self) {
-    self->items.clear();
+    self->clear();
     return &none_singleton;
 }
 
@@ -2170,11 +3952,11 @@ inline node *builtin_set_difference_update(tuple *args) {
     if (args_len < 1)
         error("bad argument to set.difference_update()");
     node *self_arg = args->items[0];
-    if (!self_arg->is_set())
+    if (!node_ref(self_arg)->is_set())
         error("bad argument to set.difference_update()");
     set *self = (set *)self_arg;
     for (int_t i = 1; i < args_len; i++) {
-        node *iter = args->items[i]->__iter__();
+        node *iter = node_ref(args->items[i])->__iter__();
         while (node *item = iter->next())
             self->discard(item);
     }
@@ -2186,41 +3968,63 @@ inline node *builtin_set_discard(set *self, node *arg) {
     return &none_singleton;
 }
 
+inline node *builtin_set_intersection_update(tuple *args) {
+    int_t args_len = args->items.size();
+    if (args_len < 1)
+        error("bad argument to set.intersection_update()");
+    node *self_arg = args->items[0];
+    if (!node_ref(self_arg)->is_set())
+        error("bad argument to set.intersection_update()");
+    set *self = (set *)self_arg;
+    for (int_t i = 1; i < args_len; i++)
+        self->intersection_update(set_arg(args->items[i]));
+    return &none_singleton;
+}
+
+inline node *builtin_set_isdisjoint(set *self, node *arg) {
+    return create_bool_const(self->isdisjoint(set_arg(arg)));
+}
+
+inline node *builtin_set_issubset(set *self, node *arg) {
+    return create_bool_const(self->issubset(set_arg(arg)));
+}
+
+inline node *builtin_set_issuperset(set *self, node *arg) {
+    return create_bool_const(set_arg(arg)->issubset(self));
+}
+
 inline node *builtin_set_remove(set *self, node *arg) {
     self->remove(arg);
     return &none_singleton;
 }
 
+inline node *builtin_set_symmetric_difference(set *self, node *arg) {
+    return self->__xor__(set_arg(arg));
+}
+
 inline node *builtin_set_update(tuple *args) {
     int_t args_len = args->items.size();
     if (args_len < 1)
         error("bad argument to set.update()");
     node *self_arg = args->items[0];
-    if (!self_arg->is_set())
+    if (!node_ref(self_arg)->is_set())
         error("bad argument to set.update()");
     set *self = (set *)self_arg;
-    for (int_t i = 1; i < args_len; i++) {
-        node *iter = args->items[i]->__iter__();
-        while (node *item = iter->next())
-            self->add(item);
-    }
+    for (int_t i = 1; i < args_len; i++)
+        self->update(args->items[i]);
     return &none_singleton;
 }
 
-inline node *builtin_sorted(node *arg) {
-    node *iter = arg->__iter__();
-    node_list new_list;
-    while (node *item = iter->next())
-        new_list.push_back(item);
-    std::stable_sort(new_list.begin(), new_list.end(), compare_nodes);
-    int_t size = new_list.size();
-    list *ret = pc_new(list)(size);
-    memcpy(&ret->items[0], &new_list[0], size*sizeof(node *));
+inline node *builtin_sorted(context *ctx, node *arg, node *key, node *reverse) {
+    list *ret = (list *)list_init(arg);
+    if (key == &none_singleton)
+        key = NULL;
+    ret->sort(ctx, key, reverse && node_bool_value(reverse));
     return ret;
 }
 
 inline node *builtin_str_join(string_const *self, node *arg) {
-    node *iter = arg->__iter__();
+    node *iter = node_ref(arg)->__iter__();
     std::string s;
     bool first = true;
     while (node *item = iter->next()) {
@@ -2228,80 +4032,410 @@ inline node *builtin_str_join(string_const *self, node *arg) {
             first = false;
         else
             s += self->c_str();
-        s += item->str();
+        s += node_ref(item)->str();
     }
-    return pc_new(string_const)(s);
+    return create_string_const(s);
 }
 
 inline node *builtin_str_split(node *self_arg, node *arg) {
     // XXX Implement correct behavior for missing separator (not the same as ' ')
     if (!arg || (arg == &none_singleton))
-        arg = pc_new(string_const)(" ");
-    if (!self_arg->is_str() || !arg->is_str() || (arg->len() != 1))
+        arg = create_string_const(" ");
+    if (!node_ref(self_arg)->is_str() || !node_ref(arg)->is_str() || (node_ref(arg)->len() != 1))
         error("bad argument to str.split()");
     string_const *self = (string_const *)self_arg;
     // XXX Implement correct behavior for this too--delimiter strings can have len>1
-    char split = arg->c_str()[0];
+    char split = node_ref(arg)->c_str()[0];
+    // The fields are slices of the string, so they share its characters
     list *ret = pc_new(list)();
-    std::string s;
-    for (auto it = self->value.begin(); it != self->value.end(); ++it) {
-        char c = *it;
-        if (c == split) {
-            ret->items.push_back(pc_new(string_const)(s));
-            s.clear();
-        }
-        else {
-            s += c;
+    size_t start = 0, len = self->length();
+    for (size_t i = 0; i < len; i++) {
+        if (self->begin()[i] == split) {
+            ret->append(self->substring(start, i - start));
+            start = i + 1;
         }
     }
-    ret->items.push_back(pc_new(string_const)(s));
+    ret->append(self->substring(start, len - start));
     return ret;
 }
 
 inline node *builtin_str_startswith(string_const *self, node *arg) {
-    if (!arg->is_str())
+    if (!node_ref(arg)->is_str())
         error("bad arguments to str.startswith()");
     std::string s1 = self->str_value();
-    std::string s2 = arg->str_value();
+    std::string s2 = node_ref(arg)->str_value();
     return create_bool_const(s1.compare(0, s2.size(), s2) == 0);
 }
 
 inline node *builtin_str_upper(string_const *self) {
     std::string new_string;
-    for (auto it = self->value.begin(); it != self->value.end(); ++it)
+    for (auto it = self->begin(); it != self->end(); ++it)
         new_string += toupper(*it);
-    return pc_new(string_const)(new_string);
+    return create_string_const(new_string);
 }
 
 inline node *builtin_tuple_count(tuple *self, node *arg) {
     int_t n = 0;
     int_t len = self->items.size();
     for (int_t i = 0; i < len; i++) {
-        if (self->items[i]->_eq(arg))
+        if (node_ref(self->items[i])->_eq(arg))
             n++;
     }
-    return pc_new(int_const)(n);
+    return create_int_const(n);
 }
 
 inline node *builtin_tuple_index(tuple *self, node *arg) {
     int_t len = self->items.size();
     for (int_t i = 0; i < len; i++) {
-        if (self->items[i]->_eq(arg))
-            return pc_new(int_const)(i);
+        if (node_ref(self->items[i])->_eq(arg))
+            return create_int_const(i);
     }
     error("item not found in tuple");
 }
 
+// GC scheduling. Collections happen at the first CollectGarbage point after
+// (threshold) bytes have been allocated since the last one. Most of them are
+// minor collections, which only mark the objects allocated since the last
+// collection; survivors are promoted to the old generation in place. Once the
+// heap has grown to (growth factor) times the live size after the last major
+// collection, or that much more has been allocated since then, the next one
+// marks the whole heap, and frees old garbage. The defaults can be set at
+// compile time (see pythonc.py), or overridden at run time by the
+// PYTHONC_GC_THRESHOLD and PYTHONC_GC_GROWTH environment variables.
+// PYTHONC_GC_THREADS likewise sets the number of threads used for marking.
+#ifndef PYTHONC_GC_THRESHOLD
+#define PYTHONC_GC_THRESHOLD (8 << 20)
+#endif
+#ifndef PYTHONC_GC_GROWTH
+#define PYTHONC_GC_GROWTH (2.0)
+#endif
+#ifndef PYTHONC_GC_THREADS
+#define PYTHONC_GC_THREADS (1)
+#endif
+
+class gc_policy {
+public:
+    uint64_t threshold;
+    double growth;
+    uint64_t major_threshold;
+    uint64_t major_interval;
+    uint64_t allocated_since_major;
+    int threads;
+
+    gc_policy() {
+        const char *env;
+        this->threshold = PYTHONC_GC_THRESHOLD;
+        if ((env = getenv("PYTHONC_GC_THRESHOLD")))
+            this->threshold = strtoull(env, NULL, 10);
+        this->growth = PYTHONC_GC_GROWTH;
+        if ((env = getenv("PYTHONC_GC_GROWTH")))
+            this->growth = strtod(env, NULL);
+        if (this->growth < 1.0)
+            error("PYTHONC_GC_GROWTH must be at least 1");
+        this->major_threshold = this->major_interval = this->threshold;
+        this->allocated_since_major = 0;
+        this->threads = PYTHONC_GC_THREADS;
+        if ((env = getenv("PYTHONC_GC_THREADS")))
+            this->threads = atoi(env);
+        if (this->threads < 1)
+            error("PYTHONC_GC_THREADS must be at least 1");
+    }
+
+    bool major_due() {
+        this->allocated_since_major += alloc.allocated_bytes;
+        return alloc.live_bytes >= this->major_threshold ||
+            this->allocated_since_major >= this->major_interval;
+    }
+
+    void update(uint64_t live_bytes, bool major) {
+        if (major) {
+            this->major_threshold = std::max(this->threshold,
+                    (uint64_t)(live_bytes * this->growth));
+            this->major_interval = std::max(this->threshold,
+                    (uint64_t)(live_bytes * (this->growth - 1.0)));
+            this->allocated_since_major = 0;
+        }
+    }
+} gc_policy;
+
+// Parallel marking. The worker threads are started at the first collection
+// and wait for each phase of the GC they help with: resetting live bits, and
+// marking from the roots, which the main thread pushes on its own mark stack.
+// Threads mark from their own stacks, and when some thread runs out of work,
+// the others hand chunks of their stacks over through a shared list. Marking
+// is done when every thread is out of work and the list is empty.
+#define MARK_CHUNK_SIZE (256)
+
+class gc_workers {
+private:
+    std::vector<std::thread> threads;
+    std::mutex lock;
+    std::condition_variable start_cv, done_cv, work_cv;
+    void (*task)(int);
+    uint64_t epoch;
+    int n_finished;
+    bool stopping;
+    std::vector<node **> chunks;
+
+    void worker(int id) {
+        uint64_t seen = 0;
+        for (;;) {
+            std::unique_lock<std::mutex> l(this->lock);
+            this->start_cv.wait(l, [&] { return this->epoch != seen || this->stopping; });
+            if (this->stopping)
+                return;
+            seen = this->epoch;
+            auto task = this->task;
+            l.unlock();
+
+            task(id);
+
+            l.lock();
+            if (++this->n_finished == this->n_threads - 1)
+                this->done_cv.notify_one();
+        }
+    }
+
+public:
+    int n_threads;
+    std::atomic<int> n_idle;
+
+    gc_workers(): task(NULL), epoch(0), n_finished(0), stopping(false),
+        n_threads(1), n_idle(0) {}
+    ~gc_workers() {
+        std::unique_lock<std::mutex> l(this->lock);
+        this->stopping = true;
+        this->start_cv.notify_all();
+        l.unlock();
+        for (auto &thread : this->threads)
+            thread.join();
+    }
+
+    // Run task(id) on every thread, with the main thread as id 0
+    void run(void (*task)(int)) {
+        if (this->threads.empty()) {
+            for (int id = 1; id < this->n_threads; id++)
+                this->threads.emplace_back(&gc_workers::worker, this, id);
+        }
+        std::unique_lock<std::mutex> l(this->lock);
+        this->task = task;
+        this->n_finished = 0;
+        this->n_idle = 0;
+        this->epoch++;
+        this->start_cv.notify_all();
+        l.unlock();
+
+        task(0);
+
+        l.lock();
+        this->done_cv.wait(l, [&] { return this->n_finished == this->n_threads - 1; });
+    }
+
+    void share(mark_stack *stack) {
+        node **chunk = (node **)malloc(MARK_CHUNK_SIZE * sizeof(node *));
+        if (!chunk)
+            error("out of memory for mark stack");
+        stack->pop_chunk(chunk, MARK_CHUNK_SIZE);
+        std::lock_guard<std::mutex> l(this->lock);
+        this->chunks.push_back(chunk);
+        this->work_cv.notify_one();
+    }
+
+    // Mark until there's no work left on any thread
+    void mark() {
+        for (;;) {
+            gc_mark_stack.drain();
+
+            std::unique_lock<std::mutex> l(this->lock);
+            this->n_idle++;
+            while (this->chunks.empty() && this->n_idle < this->n_threads)
+                this->work_cv.wait(l);
+            if (this->chunks.empty()) {
+                this->work_cv.notify_all();
+                return;
+            }
+            this->n_idle--;
+            node **chunk = this->chunks.back();
+            this->chunks.pop_back();
+            l.unlock();
+
+            for (int i = 0; i < MARK_CHUNK_SIZE; i++)
+                gc_mark_stack.push(chunk[i]);
+            free(chunk);
+        }
+    }
+} gc_workers;
+
+void mark_stack::drain() {
+    while (this->length) {
+        node *n = this->items[--this->length];
+        if (this->length)
+            __builtin_prefetch(this->items[this->length - 1]);
+        n->mark_live_children();
+        if (parallel_marking && this->length >= 2 * MARK_CHUNK_SIZE &&
+                gc_workers.n_idle.load(std::memory_order_relaxed))
+            gc_workers.share(this);
+    }
+}
+
+// GC statistics. With PYTHONC_GC_STATS=1 (or pythonc.py --gc-stats), a
+// summary of collections and heap usage is printed to stderr at exit. With
+// PYTHONC_GC_STATS=json, a JSON line is also printed after every collection.
+#ifndef PYTHONC_GC_STATS
+#define PYTHONC_GC_STATS (0)
+#endif
+
+#define GC_PAUSE_BUCKETS (32)
+
+class gc_stats {
+private:
+    double start_time;
+    uint64_t n_remembered;
+    uint64_t n_collections, n_major;
+    double total_pause, max_pause;
+    // Pause times in microseconds, by power-of-two bucket
+    uint64_t pause_histogram[GC_PAUSE_BUCKETS];
+
+    static double now() {
+        timespec t;
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        return t.tv_sec + t.tv_nsec * 1e-9;
+    }
+
+    static void large_buffer_stats(uint64_t *count, uint64_t *bytes) {
+        *count = *bytes = 0;
+        for (auto *p = large_buffers; p; p = p->next) {
+            (*count)++;
+            *bytes += p->size;
+        }
+    }
+
+public:
+    bool enabled, json;
+
+    gc_stats(): start_time(0), n_remembered(0), n_collections(0), n_major(0),
+        total_pause(0), max_pause(0) {
+        const char *env = getenv("PYTHONC_GC_STATS");
+        int level = PYTHONC_GC_STATS;
+        if (env)
+            level = !strcmp(env, "json") ? 2 : atoi(env);
+        this->enabled = level > 0;
+        this->json = level > 1;
+        memset(this->pause_histogram, 0, sizeof(this->pause_histogram));
+    }
+    ~gc_stats() {
+        if (this->enabled)
+            this->print_summary();
+    }
+
+    void start() {
+        this->start_time = now();
+        this->n_remembered = gc_remembered.size();
+    }
+
+    void end(bool major) {
+        double pause = now() - this->start_time;
+        this->n_collections++;
+        this->n_major += major;
+        this->total_pause += pause;
+        this->max_pause = std::max(this->max_pause, pause);
+        uint64_t us = (uint64_t)(pause * 1e6);
+        int bucket = std::min(63 - __builtin_clzll(us | 1), GC_PAUSE_BUCKETS - 1);
+        this->pause_histogram[bucket]++;
+
+        if (this->json) {
+            size_class_stats stats[allocator::n_size_classes];
+            alloc.get_stats(stats);
+            uint64_t blocks = 0, n_large, large_bytes;
+            for (int i = 0; i < allocator::n_size_classes; i++)
+                blocks += stats[i].blocks;
+            large_buffer_stats(&n_large, &large_bytes);
+            fprintf(stderr, "{\"gc\": %" PRIu64 ", \"major\": %s, \"pause_us\": %.1f, "
+                    "\"live_bytes\": %" PRIu64 ", \"heap_bytes\": %" PRIu64 ", "
+                    "\"remembered\": %" PRIu64 "}\n", this->n_collections,
+                    major ? "true" : "false", pause * 1e6, alloc.live_bytes,
+                    blocks * BLOCK_SIZE + large_bytes, this->n_remembered);
+        }
+    }
+
+    void print_summary() {
+        fprintf(stderr, "GC stats:\n");
+        fprintf(stderr, "  collections: %" PRIu64 " (%" PRIu64 " major, %" PRIu64 " minor)\n",
+                this->n_collections, this->n_major, this->n_collections - this->n_major);
+        fprintf(stderr, "  pause time: %.3f ms total, %.3f ms max\n",
+                this->total_pause * 1e3, this->max_pause * 1e3);
+        for (int b = 0; b < GC_PAUSE_BUCKETS; b++) {
+            if (this->pause_histogram[b])
+                fprintf(stderr, "    %10" PRIu64 " - %10" PRIu64 " us: %" PRIu64 "\n",
+                        (uint64_t)(b ? 1ull << b : 0), (uint64_t)(2ull << b),
+                        this->pause_histogram[b]);
+        }
+
+        size_class_stats stats[allocator::n_size_classes];
+        alloc.get_stats(stats);
+        fprintf(stderr, "  %10s %14s %14s %10s\n", "size", "allocated", "live", "blocks");
+        for (int i = 0; i < allocator::n_size_classes; i++)
+            fprintf(stderr, "  %10" PRIu64 " %14" PRIu64 " %14" PRIu64 " %10" PRIu64 "\n",
+                    stats[i].obj_size, stats[i].allocated, stats[i].live, stats[i].blocks);
+        uint64_t n_large, large_bytes;
+        large_buffer_stats(&n_large, &large_bytes);
+        fprintf(stderr, "  large buffers: %" PRIu64 " (%" PRIu64 " bytes)\n", n_large, large_bytes);
+        fprintf(stderr, "  chunks: %" PRIu64 " (%" PRIu64 " MB), empty blocks returned to the OS: %zu\n",
+                n_chunks, n_chunks * CHUNK_SIZE >> 20, n_free_blocks);
+
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        fprintf(stderr, "  peak RSS: %ld KB\n", usage.ru_maxrss);
+    }
+} gc_stats;
+
 void collect_garbage(context *ctx, node *ret_val) {
-    static int gc_tick = 0;
-    if (++gc_tick > 128) {
-        gc_tick = 0;
+    if (alloc.allocated_bytes < gc_policy.threshold)
+        return;
 
-        alloc.mark_dead();
+    if (gc_stats.enabled)
+        gc_stats.start();
 
-        ctx->mark_live(ret_val != NULL);
+    bool major = gc_policy.major_due();
+    gc_workers.n_threads = gc_policy.threads;
+    if (gc_workers.n_threads > 1) {
+        if (major)
+            gc_workers.run([](int id) { alloc.mark_dead(false, id, gc_workers.n_threads); });
+        else
+            gc_workers.run([](int id) { alloc.mark_dead(true, id, gc_workers.n_threads); });
+    }
+    else
+        alloc.mark_dead(!major);
+
+    // Everything live is old after a major collection, so the remembered set
+    // is only needed for minor ones
+    if (!major) {
+        for (size_t i = 0; i < gc_remembered.size(); i++)
+            mark_node_live(gc_remembered[i]);
+    }
+    gc_remembered.clear();
+
+    ctx->mark_live(ret_val != NULL);
+    for (class_def *c = all_class_defs; c; c = c->next_class_def)
+        c->mark_live();
 
-        if (ret_val)
-            ret_val->mark_live();
+    if (ret_val)
+        mark_node_live(ret_val);
+
+    if (gc_workers.n_threads > 1) {
+        parallel_marking = true;
+        gc_workers.run([](int id) { gc_workers.mark(); });
+        parallel_marking = false;
     }
+    else
+        gc_mark_stack.drain();
+
+    // Keep enough empty blocks around to allocate from until the next
+    // collection, instead of giving them back to the OS just to fault them in
+    // again
+    alloc.sweep(!major, gc_policy.threshold);
+    gc_policy.update(alloc.live_bytes, major);
+
+    if (gc_stats.enabled)
+        gc_stats.end(major);
 }
@@ -9,12 +9,14 @@ import syntax
 import transform
 
 def usage():
-    print('usage: %s [-Ov] <input.py> [args...]' % sys.argv[0])
+    print('usage: %s [-Ocv] [--gc-threshold=<bytes>] [--gc-growth=<factor>] '
+            '[--gc-threads=<n>] [--gc-stats] [--huge-pages] <input.py> [args...]'
+            % sys.argv[0])
     exit(1)
 
 args = sys.argv[1:]
 
-gcc_flags = ['-g', '-Wall', '-std=c++0x']
+gcc_flags = ['-g', '-Wall', '-std=c++0x', '-pthread']
 quiet = True
 compile_only = False
 while args:
@@ -25,6 +27,17 @@ while args:
         compile_only = True
     elif arg == '-v':
         quiet = False
+    # Default GC scheduling parameters, see collect_garbage() in backend.cpp
+    elif arg.startswith('--gc-threshold='):
+        gcc_flags += ['-DPYTHONC_GC_THRESHOLD=%d' % int(arg.split('=', 1)[1])]
+    elif arg.startswith('--gc-growth='):
+        gcc_flags += ['-DPYTHONC_GC_GROWTH=%r' % float(arg.split('=', 1)[1])]
+    elif arg.startswith('--gc-threads='):
+        gcc_flags += ['-DPYTHONC_GC_THREADS=%d' % int(arg.split('=', 1)[1])]
+    elif arg == '--gc-stats':
+        gcc_flags += ['-DPYTHONC_GC_STATS=1']
+    elif arg == '--huge-pages':
+        gcc_flags += ['-DPYTHONC_HUGE_PAGES=1']
     else:
         args = [arg] + args
         break
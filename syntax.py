@@ -51,6 +51,13 @@ builtin_methods = {
         'read': 2,
         'write': 2,
     },
+    'frozenset': {
+        'copy': 1,
+        'isdisjoint': 2,
+        'issubset': 2,
+        'issuperset': 2,
+        'symmetric_difference': 2,
+    },
     'list': {
         'append': 2,
         'count': 2,
@@ -68,7 +75,12 @@ builtin_methods = {
         'copy': 1,
         'difference_update': -1,
         'discard': 2,
+        'intersection_update': -1,
+        'isdisjoint': 2,
+        'issubset': 2,
+        'issuperset': 2,
         'remove': 2,
+        'symmetric_difference': 2,
         'update': -1,
     },
     'str': {
@@ -82,11 +94,21 @@ builtin_methods = {
         'index': 2,
     },
 }
+builtin_method_names = sorted(set(name for methods in builtin_methods.values()
+    for name in methods))
+# Keyword arguments that builtins take, after their positional arguments.
+# Missing ones are passed as NULL. These builtins can call back into Python
+# code, through a key function, say, so they also get the caller's context.
+builtin_keywords = {
+    'list.sort': ['key', 'reverse'],
+    'sorted': ['key', 'reverse'],
+}
 builtin_classes = {
     'bool': (0, 1),
     'bytes': (0, 1),
     'dict': (0, 1),
     'enumerate': 1,
+    'frozenset': (0, 1),
     'int': (0, 2),
     'list': (0, 1),
     'range': (1, 3),
@@ -135,12 +157,23 @@ def write_backend_setup(f):
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <time.h>
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <map>
+#include <mutex>
 #include <set>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <type_traits>
 #include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 class node;
 class tuple;
@@ -162,6 +195,8 @@ class context;
 
     f.write('#define LIST_BUILTIN_CLASS_METHODS(x) %s\n' %
         ' '.join('LIST_%s_CLASS_METHODS(x)' % name for name in sorted(builtin_methods)))
+    f.write('enum method_id: uint32_t { NO_METHOD_ID, %s };\n' %
+        ', '.join('METHOD_ID_%s' % name for name in builtin_method_names))
 
     for name in sorted(builtin_functions):
         f.write('node *wrapped_builtin_%s(context *ctx, tuple *args, dict *kwargs);\n' % name)
@@ -171,8 +206,21 @@ class context;
             f.write('node *wrapped_builtin_%s_%s(context *ctx, tuple *args, dict *kwargs);\n' % (class_name, name))
 
 def print_arg_logic(name, f, n_args, self_class=None, method_name=None):
-    f.write('    if (kwargs && kwargs->items.size())\n')
-    f.write('        error("%s() does not take keyword arguments");\n' % name)
+    keywords = builtin_keywords.get('%s.%s' % (self_class, name) if self_class else name, [])
+    if keywords:
+        for kw in keywords:
+            f.write('    node *kwarg_%s = NULL;\n' % kw)
+        f.write('    if (kwargs && kwargs->used) {\n')
+        f.write('        uint32_t n_kwargs = 0;\n')
+        for kw in keywords:
+            f.write('        if ((kwarg_%s = kwargs->lookup_str("%s")))\n' % (kw, kw))
+            f.write('            n_kwargs++;\n')
+        f.write('        if (n_kwargs != kwargs->used)\n')
+        f.write('            error("%s() got an unexpected keyword argument");\n' % name)
+        f.write('    }\n')
+    else:
+        f.write('    if (kwargs && kwargs->used)\n')
+        f.write('        error("%s() does not take keyword arguments");\n' % name)
 
     if isinstance(n_args, tuple):
         (min_args, max_args) = n_args
@@ -186,22 +234,26 @@ def print_arg_logic(name, f, n_args, self_class=None, method_name=None):
             f.write('    node *arg%d = args->items[%d];\n' % (i, i))
         for i in range(min_args, max_args):
             f.write('    node *arg%d = (args_len > %d) ? args->items[%d] : NULL;\n' % (i, i, i))
-        return ', '.join('arg%d' % i for i in range(max_args))
+        args = ['arg%d' % i for i in range(max_args)]
     elif n_args < 0:
-        return 'args'
+        args = ['args']
     else:
         f.write('    if (args->items.size() != %d)\n' % n_args)
         f.write('        error("wrong number of arguments to %s()");\n' % name)
         for i in range(n_args):
             f.write('    node *arg%d = args->items[%d];\n' % (i, i))
         if self_class:
-            f.write('    if (!arg0->is_%s())\n' % self_class)
+            f.write('    if (!node_ref(arg0)->is_%s())\n' % self_class)
             f.write('        error("bad argument to %s.%s()");\n' % (self_class, method_name))
             class_name = {'str': 'string_const', 'int': 'int_const'}.get(self_class, self_class)
             f.write('    %s *self = (%s *)arg0;\n' % (class_name, class_name))
-            return ', '.join(['self'] + ['arg%d' % i for i in range(1, n_args)])
+            args = ['self'] + ['arg%d' % i for i in range(1, n_args)]
         else:
-            return ', '.join('arg%d' % i for i in range(n_args))
+            args = ['arg%d' % i for i in range(n_args)]
+
+    if keywords:
+        args = ['ctx'] + args + ['kwarg_%s' % kw for kw in keywords]
+    return ', '.join(args)
 
 def write_backend_post_setup(f):
     for name in sorted(builtin_functions):
@@ -258,6 +310,7 @@ def write_backend_post_setup(f):
         f.write('    virtual const char *type_name() { return "module_%s"; }\n' % name)
         f.write('} module_%s_singleton;\n' % name)
 
+    # Only ints that don't fit in a tagged pointer need an actual object
     for i in sorted(all_ints):
         f.write('int_const_singleton %s(%sll);\n' % (int_name(i), i))
 
@@ -276,6 +329,8 @@ def write_backend_post_setup(f):
         f.write('const uint8_t bytes_singleton_%d_data[] = {%s};\n' % (v, ', '.join(str(x) for x in k)))
         f.write('bytes_singleton bytes_singleton_%d(sizeof(bytes_singleton_%d_data), bytes_singleton_%d_data);\n' % (v, v, v))
 
+    f.write('attr_cache attr_caches[%d];\n' % max(n_attr_caches, 1))
+
 def globals_init(ctx):
     stmts = [Store('__name__', StringConst(ctx.module))]
     for t, l in [['function', builtin_functions], ['class', builtin_classes]]:
@@ -301,7 +356,9 @@ def write_output(stmts, path):
         f.write('    context *ctx = &ctx___main__, *globals = ctx;\n')
         f.write('    list *args = (list *)module_sys_singleton.getattr("argv");\n')
         f.write('    for (int_t a = 0; a < argc; a++)\n')
-        f.write('        args->append(pc_new(string_const)(argv[a]));\n')
+        f.write('        args->append(create_string_const(argv[a]));\n')
+        for decl in ctx.unboxed_decls:
+            f.write('    %s\n' % decl)
         f.write(indent(stmts))
         f.write('\n}\n')
 
@@ -313,10 +370,18 @@ def indent(stmts, spaces=4):
 def block_str(stmts, spaces=4):
     return indent((s() for s in stmts), spaces=spaces)
 
+# Range of ints that can be stored directly in a tagged node pointer
+TAGGED_INT_MIN = -(1 << 62)
+TAGGED_INT_MAX = (1 << 62) - 1
+
+def int_fits_tag(value):
+    return TAGGED_INT_MIN <= value <= TAGGED_INT_MAX
+
 all_ints = set()
 def register_int(value):
     global all_ints
-    all_ints |= {value}
+    if not int_fits_tag(value):
+        all_ints |= {value}
 
 all_strings = {}
 def register_string(value):
@@ -332,6 +397,13 @@ def register_string(value):
     all_strings[value] = (len(all_strings), hashkey)
     return all_strings[value][0]
 
+# Inline caches, one for each attribute access in the program
+n_attr_caches = 0
+def new_attr_cache():
+    global n_attr_caches
+    n_attr_caches += 1
+    return n_attr_caches - 1
+
 all_bytes = {}
 def register_bytes(value):
     global all_bytes
@@ -404,14 +476,22 @@ class Context:
         # Add all the statements. This reduces/flattens as well.
         for i in stmts:
             self.add_statement(i)
-        stmts = [s.value for s in self.statements]
 
-        all_globals = set()
+        # Bind calls of functions that are never rebound directly, and make
+        # int specializations of functions
+        functions = constant_functions(self, self.statements)
+        find_direct_calls(self, self.statements, functions, set())
+        for scope in self.functions + self.classes:
+            find_direct_calls(self, scope.stmts, functions, get_globals_locals(scope)[1])
+        specialize_functions(self)
+        stmts = [s.value for s in self.statements]
 
         # Get bindings for all classes/functions
+        fn_globals = set()
         for node in self.classes + self.functions:
             assert isinstance(node, (ClassDef, FunctionDef))
-            all_globals |= node.set_binding(self)
+            fn_globals |= node.set_binding(self)
+        all_globals = set(fn_globals)
 
         for node in stmts:
             if isinstance(node, Global):
@@ -434,7 +514,24 @@ class Context:
 
         self.global_sym_count = len(self.global_idx) + 1
 
-        return stmts
+        # Unbox ints and bools where possible. Globals of the main module are
+        # private to its top-level code unless a class or function uses them.
+        for node in self.functions:
+            node.unboxed_decls = infer_types(node.stmts, node.local_names)
+        self.unboxed_decls = []
+        if self.module == '__main__':
+            self.unboxed_decls = infer_types(self.statements, all_globals - fn_globals)
+
+        # Lay out the root slots of each frame, after moving the argument
+        # tuples that don't escape into it
+        for node in self.functions:
+            find_stack_tuples(node.stmts)
+            node.stmts, node.root_count = assign_root_slots(node.stmts, 'root_slots')
+        find_stack_tuples(self.statements)
+        self.statements, self.root_count = assign_root_slots(self.statements,
+                'root_slots_%s' % self.module)
+
+        return [s.value for s in self.statements]
 
     def write_mod_init(self, f):
         for mod in self.modules:
@@ -442,12 +539,29 @@ class Context:
 
         f.write('node *mod_syms_%s[%s] = {};\n' % (self.module,
             self.global_sym_count))
-        f.write('context ctx_%s(%s, mod_syms_%s);\n' % (self.module,
-            self.global_sym_count, self.module))
+        if self.root_count:
+            f.write('node *root_slots_%s[%s] = {};\n' % (self.module,
+                self.root_count))
+            f.write('context ctx_%s(%s, mod_syms_%s, %s, root_slots_%s);\n' % (
+                self.module, self.global_sym_count, self.module,
+                self.root_count, self.module))
+        else:
+            f.write('context ctx_%s(%s, mod_syms_%s);\n' % (self.module,
+                self.global_sym_count, self.module))
+        # Methods can refer to their class, so classes are declared first, and
+        # functions can call each other directly
+        for cls in self.classes:
+            f.write('%s\n' % cls.declaration())
+        for func in self.functions:
+            f.write('%s;\n' % func.prototype())
         for func in self.modules + self.functions + self.classes:
             f.write('%s\n' % func)
 
 class Node:
+    # Native C++ type ('int' or 'bool') this node evaluates to, if it has been
+    # unboxed by type inference. Nodes without one evaluate to a node *.
+    ctype = None
+
     def add_use(self, edge):
         assert edge not in self.uses
         self.uses.append(edge)
@@ -540,6 +654,22 @@ def node(argstr='', no_flatten=[], const=False):
                         for i in edge().iterate_subtree():
                             yield i
 
+        # Edges to expressions used by this node, not including enclosed blocks
+        def iterate_edges(self):
+            for (arg_type, arg_name) in args:
+                if arg_type == ARG_EDGE:
+                    edge = getattr(self, arg_name)
+                    if edge:
+                        yield edge
+                elif arg_type == ARG_EDGE_LIST:
+                    for edge in getattr(self, arg_name):
+                        yield edge
+
+        def iterate_blocks(self):
+            for (arg_type, arg_name) in args:
+                if arg_type == ARG_BLOCK:
+                    yield getattr(self, arg_name)
+
         def reduce_internal(self, ctx):
             if hasattr(self, 'reduce'):
                 new_self = self.reduce(ctx)
@@ -586,6 +716,8 @@ def node(argstr='', no_flatten=[], const=False):
                 
         node.__init__ = __init__
         node.iterate_subtree = iterate_subtree
+        node.iterate_edges = iterate_edges
+        node.iterate_blocks = iterate_blocks
         node.reduce_internal = reduce_internal
         node.flatten = flatten
         node.print_tree = print_tree
@@ -614,6 +746,8 @@ class NoneConst(Node):
 @node('value', const=True)
 class BoolConst(Node):
     def __str__(self):
+        if self.ctype:
+            return 'true' if self.value else 'false'
         return '(&bool_singleton_%s)' % self.value
 
 @node('value', const=True)
@@ -622,6 +756,10 @@ class IntConst(Node):
         register_int(self.value)
 
     def __str__(self):
+        if self.ctype:
+            return '%sll' % self.value
+        if int_fits_tag(self.value):
+            return 'tag_int(%sll)' % self.value
         return '(&%s)' % int_name(self.value)
 
 @node('value', const=True)
@@ -658,12 +796,28 @@ class SingletonRef(Node):
 @node('ref_type, args')
 class Ref(Node):
     def __str__(self):
-        return '(pc_new(%s)(%s))' % (self.ref_type, ', '.join(str(a) for a in self.args))
+        args = ', '.join(str(a) for a in self.args)
+        # Tuples store their items inline, so they're allocated by size
+        if self.ref_type == 'tuple':
+            return 'create_tuple(%s)' % args
+        return '(pc_new(%s)(%s))' % (self.ref_type, args)
 
 @node('op, &rhs')
 class UnaryOp(Node):
     def __str__(self):
-        return '%s->%s()' % (self.rhs(), self.op)
+        if self.ctype:
+            if self.op == '__not__':
+                return '(!%s)' % self.rhs()
+            return '(%s(int_t)%s)' % (native_unops[self.op], self.rhs())
+        if self.op == '__not__':
+            return 'unop_not(%s)' % self.rhs()
+        return 'node_ref(%s)->%s()' % (self.rhs(), self.op)
+
+# Binary operators with an inline fast path for tagged ints in the backend
+inline_binops = {'__%s__' % op for op in ['add', 'and', 'floordiv', 'lshift',
+    'mod', 'mul', 'or', 'rshift', 'sub', 'xor', 'iadd', 'iand', 'ifloordiv',
+    'ilshift', 'imod', 'imul', 'ior', 'irshift', 'isub', 'ixor', 'eq', 'ne',
+    'lt', 'le', 'gt', 'ge', 'is', 'isnot']}
 
 @node('op, &lhs, &rhs')
 class BinaryOp(Node):
@@ -684,7 +838,16 @@ class BinaryOp(Node):
         return self
 
     def __str__(self):
-        return '%s->%s(%s)' % (self.lhs(), self.op, self.rhs())
+        if self.ctype:
+            op = binop_name(self.op)
+            expr = '(%s %s %s)' % (self.lhs(), native_binops[op], self.rhs())
+            # Bitwise ops on two bools give an int in C++
+            if self.ctype == 'bool' and op in native_bitops:
+                expr = '(bool)%s' % expr
+            return expr
+        if self.op in inline_binops:
+            return 'binop_%s(%s, %s)' % (self.op[2:-2], self.lhs(), self.rhs())
+        return 'node_ref(%s)->%s(%s)' % (self.lhs(), self.op, self.rhs())
 
 @node('name')
 class Load(Node):
@@ -696,6 +859,8 @@ class Load(Node):
         self.idx = idx
 
     def __str__(self):
+        if self.ctype:
+            return self.native_name
         if self.scope == 'global':
             return 'globals->load(%s)' % self.idx
         elif self.scope == 'class':
@@ -706,6 +871,9 @@ class Load(Node):
 
 @node('name, &expr', no_flatten=['expr'])
 class Store(Node):
+    # Set by type inference for a native store that's never loaded
+    dead = False
+
     def setup(self):
         self.scope = 'global'
 
@@ -714,6 +882,10 @@ class Store(Node):
         self.idx = idx
 
     def __str__(self):
+        if self.dead:
+            return ''
+        if self.ctype:
+            return '%s = %s' % (self.native_name, self.expr())
         if self.scope == 'global':
             return 'globals->store(%s, %s)' % (self.idx, self.expr())
         elif self.scope == 'class':
@@ -724,23 +896,38 @@ class Store(Node):
 
 @node('&name, attr, &expr', no_flatten=['expr'])
 class StoreAttr(Node):
+    # (class name, index) for a store to a field of self, set by the transformer
+    field = None
+
+    def setup(self):
+        self.cache = new_attr_cache()
+
     def __str__(self):
-        return '%s->__setattr__(%s, %s)' % (self.name(), self.attr, self.expr())
+        if self.field:
+            return 'store_field(%s, &class_%s_singleton, %d, %s, %s, &attr_caches[%d])' % (
+                    self.name(), self.field[0], self.field[1], self.attr, self.expr(), self.cache)
+        return 'store_attr(%s, %s, %s, &attr_caches[%d])' % (self.name(), self.attr,
+                self.expr(), self.cache)
 
 @node('&name, &index, &expr', no_flatten=['expr'])
 class StoreSubscript(Node):
     def __str__(self):
-        return '%s->__setitem__(%s, %s)' % (self.name(), self.index(), self.expr())
+        return 'node_ref(%s)->__setitem__(%s, %s)' % (self.name(), self.index(), self.expr())
 
 @node('&expr, &index')
 class DeleteSubscript(Node):
     def __str__(self):
-        return '%s->__delitem__(%s)' % (self.expr(), self.index())
+        return 'node_ref(%s)->__delitem__(%s)' % (self.expr(), self.index())
 
 @node('&expr, index, &value')
 class StoreSubscriptDirect(Node):
+    # Set by find_stack_tuples() for stack tuples, which don't need a barrier
+    direct = False
+
     def __str__(self):
-        return '%s->items[%d] = %s' % (self.expr(), self.index, self.value())
+        if self.direct:
+            return '%s->items[%d] = %s' % (self.expr(), self.index, self.value())
+        return '%s->set_item(%d, %s)' % (self.expr(), self.index, self.value())
 
 @node('&obj, method_name, *args')
 class MethodCall(Node):
@@ -770,12 +957,14 @@ class Tuple(Node):
 class TupleFromIter(Node):
     def reduce(self, ctx):
         name = ctx.get_temp_id()
-        ctx.add_statement(Assign(name, Ref('tuple', []), 'tuple'))
-        iter_temp = ctx.get_temp()
-        stmts = [MethodCall(name, 'append', [Load(iter_temp)])]
-        ctx.add_statement(For(iter_temp, self.items(), stmts))
+        ctx.add_statement(Assign(name, TupleInit(self.items()), 'tuple'))
         return name
 
+@node('&items')
+class TupleInit(Node):
+    def __str__(self):
+        return 'tuple_from_iter(%s)' % self.items()
+
 @node('*keys, *values')
 class Dict(Node):
     def reduce(self, ctx):
@@ -797,22 +986,114 @@ class Set(Node):
 @node('&expr, &start, &end, &step')
 class Slice(Node):
     def __str__(self):
-        return '%s->__slice__(%s, %s, %s)' % (self.expr(), self.start(), self.end(), self.step())
+        return 'node_ref(%s)->__slice__(%s, %s, %s)' % (self.expr(), self.start(), self.end(), self.step())
 
 @node('&expr, &index')
 class Subscript(Node):
     def __str__(self):
-        return '%s->__getitem__(%s)' % (self.expr(), self.index())
+        return 'node_ref(%s)->__getitem__(%s)' % (self.expr(), self.index())
 
 @node('&expr, &attr')
 class Attribute(Node):
+    # (class name, index) for a load of a field of self, set by the transformer
+    field = None
+
+    def setup(self):
+        self.cache = new_attr_cache()
+
     def __str__(self):
-        return '%s->__getattr__(%s)' % (self.expr(), self.attr())
+        if self.field:
+            return 'load_field(%s, &class_%s_singleton, %d, %s, &attr_caches[%d])' % (
+                    self.expr(), self.field[0], self.field[1], self.attr(), self.cache)
+        # Constants are never objects, so they don't need the cache
+        if type(self.expr()).is_const or isinstance(self.expr(), NoneConst):
+            return 'node_ref(%s)->__getattr__(%s)' % (self.expr(), self.attr())
+        return 'load_attr(%s, %s, &attr_caches[%d])' % (self.expr(), self.attr(), self.cache)
 
 @node('&func, &args, &kwargs')
 class Call(Node):
     def __str__(self):
-        return '%s->__call__(ctx, %s, %s)' % (self.func(), self.args(), self.kwargs())
+        return 'call_function(ctx, %s, %s, %s)' % (self.func(), self.args(), self.kwargs())
+
+# A call of a function known at compile time, from find_direct_calls(). The
+# arguments are bound to the parameters already, with NULL for ones that get
+# their default. If the function has an int specialization, and the arguments
+# for its int parameters are native ints, this calls that instead.
+@node('fn, *args')
+class DirectCall(Node):
+    def int_args(self):
+        args = []
+        for i, edge in enumerate(self.args):
+            arg = edge()
+            if i in self.fn.int_clone.int_params:
+                if isinstance(arg, Box) and arg.expr().ctype == 'int':
+                    arg = arg.expr()
+                elif isinstance(arg, IntConst) and -(1 << 63) < arg.value < (1 << 63):
+                    arg = '%sll' % arg.value
+                else:
+                    return None
+            args.append(arg)
+        return args
+
+    def __str__(self):
+        args = self.int_args() if self.fn.int_clone else None
+        entry = 'int'
+        if args is None:
+            entry, args = 'direct', [a() for a in self.args]
+        return '%s_%s(ctx%s)' % (self.fn.exp_name, entry, ''.join(', %s' % a for a in args))
+
+# A call of obj.attr(...), which calls a method with obj as self without
+# making a bound method. As with CPython's LOAD_METHOD, the method is looked up
+# before the arguments are evaluated, into a temporary, with obj in another.
+# If the type has no such method, the first is NULL, and the second gets the
+# attribute, to be called as usual.
+@node('&obj, attr, &args, &kwargs, &method')
+class CallMethod(Node):
+    def reduce(self, ctx):
+        if self.method:
+            return self
+        load = LoadMethod(self.obj(), self.attr)
+        method = ctx.get_temp()
+        ctx.add_statement(Assign(Identifier(method), load, 'node'))
+
+        # obj is an atom now, so it can be used again
+        def dup_obj():
+            obj = copy.copy(load.obj())
+            obj.uses = []
+            return obj
+        fallback = Attribute(dup_obj(), self.attr)
+        fallback.cache = load.cache
+        method_self = ctx.get_temp()
+        ctx.add_statement(Assign(Identifier(method_self),
+            MethodSelf(Identifier(method), dup_obj(), fallback), 'node'))
+
+        self.obj.set(Identifier(method_self))
+        self.method = Edge(Identifier(method))
+        return self
+
+    def __str__(self):
+        return 'call_method(ctx, %s, %s, %s, %s)' % (self.method(), self.obj(),
+                self.args(), self.kwargs())
+
+# The method for a CallMethod, or NULL. Names of builtin methods get their
+# method ID, so builtin types find the method without comparing strings.
+@node('&obj, attr')
+class LoadMethod(Node):
+    def setup(self):
+        self.cache = new_attr_cache()
+
+    def __str__(self):
+        method_id = 'NO_METHOD_ID'
+        if self.attr.value in builtin_method_names:
+            method_id = 'METHOD_ID_%s' % self.attr.value
+        return 'load_method(%s, %s, %s, &attr_caches[%d])' % (self.obj(),
+                self.attr, method_id, self.cache)
+
+# Self for a CallMethod: obj if there is a method, or else the attribute
+@node('&method, &obj, &fallback', no_flatten=['fallback'])
+class MethodSelf(Node):
+    def __str__(self):
+        return '(%s ? %s : %s)' % (self.method(), self.obj(), self.fallback())
 
 @node('&expr, &true_expr, &false_expr')
 class IfExp(Node):
@@ -837,26 +1118,61 @@ class BoolOp(Node):
 
 @node('&target, &expr, target_type', no_flatten=['expr'])
 class Assign(Node):
-    def __str__(self):
-        target_type = ('%s *' % self.target_type) if self.target_type else ''
-        return '%s%s = %s' % (target_type, self.target(), self.expr())
+    # Root slot the target is kept in, from assign_root_slots()
+    root = None
+    # Whether the target is a tuple in the C++ frame, from find_stack_tuples()
+    stack = False
 
-@node('&name')
-class PushTemp(Node):
     def __str__(self):
-        return 'ctx->push(%s)' % self.name()
+        if self.stack:
+            name = self.target()
+            body = 'stack_tuple<%s> %s_obj;\ntuple *%s = &%s_obj' % (
+                    self.expr().args[0], name, name, name)
+        else:
+            if self.ctype:
+                target_type = ('%s ' % native_ctypes[self.ctype]) if self.target_type else ''
+            else:
+                target_type = ('%s *' % self.target_type) if self.target_type else ''
+            body = '%s%s = %s' % (target_type, self.target(), self.expr())
+        if self.root:
+            body += ';\n%s = %s' % (self.root, self.target())
+        return body
 
-@node('')
-class PopTemp(Node):
+# Clear the root slot of a temporary once it's dead, so it doesn't keep its
+# value alive. Dropped by assign_root_slots() if the temporary has no slot.
+@node('&name')
+class ClearRoot(Node):
     def __str__(self):
-        return 'ctx->pop()'
+        return '%s = NULL' % self.root
 
 @node('&expr')
 class Test(Node):
     def __str__(self):
-        return '%s->bool_value()' % self.expr()
+        if self.expr().ctype == 'int':
+            return '(%s != 0)' % self.expr()
+        elif self.expr().ctype == 'bool':
+            return '%s' % self.expr()
+        return 'node_bool_value(%s)' % self.expr()
 
 # Don't flatten since we can't store NULL in the symbol table
+# Box a native value from type inference into a node *
+@node('&expr')
+class Box(Node):
+    def __str__(self):
+        return 'create_%s_const(%s)' % (self.expr().ctype, self.expr())
+
+# Convert a value to an int, as range() does with its arguments
+@node('&expr')
+class IntValue(Node):
+    def __str__(self):
+        if self.expr().ctype:
+            value = '(int_t)%s' % self.expr()
+        else:
+            value = 'node_int_value(%s)' % self.expr()
+        if self.ctype:
+            return value
+        return 'create_int_const(%s)' % value
+
 @node('&expr', no_flatten=['expr'])
 class TestNonNull(Node):
     def __str__(self):
@@ -884,6 +1200,35 @@ class If(Node):
 }}""".format(stmts=false_stmts)
         return body
 
+# A C++ array of node pointers, declared uninitialized
+@node('name, count')
+class TempArray(Node):
+    def __str__(self):
+        return 'node *%s[%d]' % (self.name, self.count)
+
+@node('&iter, items, count')
+class NextUnpack(Node):
+    def __str__(self):
+        return '%s->next_unpack(%d, %s)' % (self.iter(), self.count, self.items)
+
+# Statements at the top of a loop body that store the next item of an iterator
+# in the loop target, or break out of the loop. Unpacked items go through a
+# C++ array instead of being subscripted, so iterators that make a tuple for
+# each item don't have to allocate it.
+def next_item(ctx, iter_name, target):
+    if isinstance(target, list):
+        items = ctx.get_temp()
+        stmts = [TempArray(items, len(target))]
+        stmts += [If(NextUnpack(iter_name, items, len(target)), [], [Break()])]
+        for i, t in enumerate(target):
+            stmts += [Store(t, Identifier('%s[%d]' % (items, i)))]
+    else:
+        item = ctx.get_temp_id()
+        stmts = [Assign(item, MethodCall(iter_name, 'next', []), 'node')]
+        stmts += [If(item, [], [Break()])]
+        stmts += [Store(target, item)]
+    return stmts
+
 @node('comp_type, target, &iter, &cond, &expr, &expr2')
 class Comprehension(Node):
     def reduce(self, ctx):
@@ -897,21 +1242,9 @@ class Comprehension(Node):
         ctx.add_statement(Assign(temp, l, self.comp_type))
         iter_name = ctx.get_temp_id()
         ctx.add_statement(Assign(iter_name, UnaryOp('__iter__', self.iter()), 'node'))
-        ctx.add_statement(PushTemp(iter_name))
 
         # Construct body of while loop that implements comprehension
-        # Get next item of iterable
-        iter_next = MethodCall(iter_name, 'next', [])
-        item = ctx.get_temp_id()
-        stmts = [Assign(item, iter_next, 'node')]
-        stmts += [If(item, [], [Break()])]
-
-        # Unpack arguments
-        if isinstance(self.target, tuple):
-            for i, target in enumerate(self.target):
-                stmts += [Store(target, '%s->__getitem__(%s)' % (item, i))]
-        else:
-            stmts += [Store(self.target, item)]
+        stmts = next_item(ctx, iter_name, self.target)
 
         # Condtional
         if self.cond:
@@ -925,7 +1258,7 @@ class Comprehension(Node):
             stmts += [MethodCall(temp, 'append', [self.expr()])]
 
         ctx.add_statement(While(stmts))
-        ctx.add_statement(PopTemp())
+        ctx.add_statement(ClearRoot(iter_name))
 
         return temp
 
@@ -939,31 +1272,43 @@ class Continue(Node):
     def __str__(self):
         return 'continue'
 
+# Iteration over range() with a constant step, created by the transformer when
+# range isn't rebound. For loops over these just count instead of creating an
+# iterator, which lets the loop variable be unboxed.
+@node('&start, &stop, step')
+class RangeIter(Node):
+    pass
+
 @node('target, &iter, $stmts')
 class For(Node):
     def reduce(self, ctx):
+        if isinstance(self.iter(), RangeIter):
+            return self.reduce_range(ctx)
+
         iter_name = ctx.get_temp_id()
         ctx.add_statement(Assign(iter_name, UnaryOp('__iter__', self.iter()), 'node'))
-        ctx.add_statement(PushTemp(iter_name))
-
-        # Get next item of iterable
-        iter_next = MethodCall(iter_name, 'next', [])
-        item = ctx.get_temp_id()
-        stmts = [Assign(item, iter_next, 'node')]
-        stmts += [If(item, [], [Break()])]
-
-        # Unpack arguments
-        if isinstance(self.target, list):
-            for i, target in enumerate(self.target):
-                stmts += [Store(target, MethodCall(item, '__getitem__', [IntConst(i)]))]
-        else:
-            stmts += [Store(self.target, item)]
 
+        stmts = next_item(ctx, iter_name, self.target)
         stmts += [s() for s in self.stmts]
 
         ctx.add_statement(While(stmts))
 
-        return PopTemp()
+        return ClearRoot(iter_name)
+
+    def reduce_range(self, ctx):
+        iter = self.iter()
+        counter = ctx.get_temp()
+        stop = ctx.get_temp()
+        ctx.add_statement(Store(counter, IntValue(iter.start())))
+        ctx.add_statement(Store(stop, IntValue(iter.stop())))
+
+        cmp_op = '__ge__' if iter.step > 0 else '__le__'
+        stmts = [If(Test(BinaryOp(cmp_op, Load(counter), Load(stop))), [Break()], [])]
+        stmts += [Store(self.target, Load(counter))]
+        stmts += [Store(counter, BinaryOp('__add__', Load(counter), IntConst(iter.step)))]
+        stmts += [s() for s in self.stmts]
+
+        return While(stmts)
 
 @node('$stmts')
 class While(Node):
@@ -989,7 +1334,7 @@ class Return(Node):
 @node('&expr, lineno')
 class Assert(Node):
     def __str__(self):
-        body = """if (!{expr}->bool_value()) {{
+        body = """if (!node_bool_value({expr})) {{
     error("assert failed at line {lineno}");
 }}""".format(expr=self.expr(), lineno=self.lineno)
         return body
@@ -1004,40 +1349,36 @@ class CollectGarbage(Node):
     def __str__(self):
         return 'collect_garbage(ctx, %s)' % (self.expr() if self.expr else 'NULL')
 
+# A parameter of the direct entry point of a function. In an int
+# specialization, the int parameters are native.
+@node('index')
+class FixedArg(Node):
+    native = False
+
+    def __str__(self):
+        return 'arg%d' % self.index
+
 @node('args, *defaults, vararg, kwonlyargs, *kw_defaults')
 class Arguments(Node):
+    def setup(self):
+        self.kwonlyargs = self.kwonlyargs or []
+        self.n_required = len(self.args) - len(self.defaults)
+        self.names = self.args + self.kwonlyargs
+
     def reduce(self, ctx):
-        defaults = [None] * (len(self.args) - len(self.defaults))
-        defaults += self.defaults
-        name_strings = [Edge(StringConst(a)) for a in self.args]
-
-        args = Identifier('args')
-        kwargs = Identifier('kwargs')
-        for i, (arg, default, name) in enumerate(zip(self.args, defaults, name_strings)):
-            arg_value = Subscript(args, IntConst(i))
+        # The arguments have already been bound to the parameters of the
+        # direct entry point, so they just need the defaults for the ones that
+        # were left out
+        defaults = [None] * self.n_required
+        defaults += self.defaults + self.kw_defaults
+        for i, (arg, default) in enumerate(zip(self.names, defaults)):
+            arg_value = FixedArg(i)
             if default:
-                comp = BinaryOp('_gt', MethodCall(args, '__len__', []), IntConst(i))
-                arg_value = IfExp(comp, arg_value, default())
-
-            lookup = MethodCall(kwargs, 'lookup', [name()])
-            arg_value = IfExp(Test(BoolOp('and', TestNonNull(kwargs),
-                TestNonNull(lookup))), lookup, arg_value)
-
+                arg_value = IfExp(Test(TestNonNull(FixedArg(i))), FixedArg(i), default())
             ctx.add_statement(Store(arg, arg_value))
 
-        # Meh, figure out a way to reduce copy/paste
-        if self.kwonlyargs:
-            name_strings = [Edge(StringConst(a)) for a in self.kwonlyargs]
-            for i, (arg, default, name) in enumerate(zip(self.kwonlyargs, self.kw_defaults, name_strings)):
-                lookup = MethodCall(kwargs, 'lookup', [name()])
-                arg_value = IfExp(Test(BoolOp('and', TestNonNull(kwargs),
-                    TestNonNull(lookup))), lookup, default())
-
-                ctx.add_statement(Store(arg, arg_value))
-
         if self.vararg:
-            vararg = MethodCall(args, '__slice__', [IntConst(len(self.args)), NoneConst(), NoneConst()])
-            ctx.add_statement(Store(self.vararg, vararg))
+            ctx.add_statement(Store(self.vararg, FixedArg(len(self.names))))
 
         return self
 
@@ -1065,25 +1406,606 @@ def get_globals_locals(node):
 
     return all_globals, all_locals
 
+# Type inference. Variables whose values are provably always ints (or always
+# bools) are kept in native C++ variables instead of the symbol table, and only
+# get boxed when they are used by something generic. The same variable is often
+# used for unrelated values in different parts of a function, so the analysis
+# works on webs: sets of stores and loads of a variable that are linked by
+# reaching definitions. Each web gets its own type and its own C++ variable.
+native_ctypes = {'int': 'int_t', 'bool': 'bool'}
+native_binops = {
+    'add': '+', 'and': '&', 'floordiv': '/', 'lshift': '<<', 'mod': '%',
+    'mul': '*', 'or': '|', 'rshift': '>>', 'sub': '-', 'xor': '^',
+    'eq': '==', 'ne': '!=', 'lt': '<', 'le': '<=', 'gt': '>', 'ge': '>=',
+}
+native_bitops = {'and', 'or', 'xor'}
+native_cmpops = {'eq', 'ne', 'lt', 'le', 'gt', 'ge'}
+native_unops = {'__neg__': '-', '__pos__': '+', '__invert__': '~', '__not__': '!'}
+
+def binop_name(op):
+    # '__iadd__' -> 'add'
+    name = op[2:-2] if op.startswith('__') else op
+    if name.startswith('i') and name[1:] in native_binops:
+        name = name[1:]
+    return name
+
+# Types are None (nothing known yet), 'int', 'bool', or 'any'
+def join_types(a, b):
+    if a is None:
+        return b
+    if b is None or a == b:
+        return a
+    return 'any'
+
+def binary_op_type(op, lhs, rhs):
+    op = binop_name(op)
+    if op not in native_binops or 'any' in (lhs, rhs):
+        return 'any'
+    if lhs is None or rhs is None:
+        return None
+    if op in native_cmpops or (op in native_bitops and lhs == rhs == 'bool'):
+        return 'bool'
+    return 'int'
+
+def unary_op_type(op, rhs):
+    if op not in native_unops or rhs == 'any':
+        return 'any'
+    if rhs is None:
+        return None
+    return 'bool' if op == '__not__' else 'int'
+
+class Web:
+    def __init__(self, name, from_entry=False):
+        self.name = name
+        # Webs reached by the value a variable has on entry (from the caller,
+        # or undefined) always stay boxed
+        self.from_entry = from_entry
+        self.stores = []
+        self.parent = None
+        self.type = None
+
+    def find(self):
+        web = self
+        while web.parent:
+            web = web.parent
+        return web
+
+    def union(self, other):
+        a, b = self.find(), other.find()
+        if a is not b:
+            b.parent = a
+            a.from_entry |= b.from_entry
+            a.stores += b.stores
+        return a
+
+class TypeInference:
+    def __init__(self, names):
+        self.names = names
+        self.store_webs = {}
+        self.load_webs = {}
+        self.loops = []
+        self.temp_assigns = {}
+        self.temp_types = {}
+        self.native_names = {}
+        self.decls = []
+
+    # Reaching definitions. A state maps each variable to the set of webs whose
+    # stores can reach the current point, or is None when it's unreachable.
+    def merge(self, *states):
+        states = [s for s in states if s is not None]
+        if not states:
+            return None
+        return {name: frozenset().union(*(s[name] for s in states))
+                for name in self.names}
+
+    def walk_expr(self, node, state):
+        if isinstance(node, Load) and node.name in self.names:
+            web = self.load_webs.get(node)
+            if web is None:
+                web = self.load_webs[node] = Web(node.name)
+            # Loads in unreachable code are left alone
+            if state is None:
+                web.from_entry = True
+            else:
+                for other in state[node.name]:
+                    web = web.union(other)
+        for edge in node.iterate_edges():
+            self.walk_expr(edge(), state)
+
+    def walk_block(self, stmts, state):
+        for edge in stmts:
+            state = self.walk_stmt(edge(), state)
+        return state
+
+    def walk_stmt(self, stmt, state):
+        if isinstance(stmt, If):
+            self.walk_expr(stmt.expr(), state)
+            return self.merge(self.walk_block(stmt.true_stmts, state),
+                    self.walk_block(stmt.false_stmts, state))
+        elif isinstance(stmt, While):
+            # Iterate until the state at the top of the loop stops changing
+            entry = state
+            while True:
+                self.loops.append(([], []))
+                end = self.walk_block(stmt.stmts, entry)
+                breaks, continues = self.loops.pop()
+                new_entry = self.merge(state, end, *continues)
+                if new_entry == entry:
+                    return self.merge(*breaks)
+                entry = new_entry
+        elif isinstance(stmt, Break):
+            self.loops[-1][0].append(state)
+            return None
+        elif isinstance(stmt, Continue):
+            self.loops[-1][1].append(state)
+            return None
+
+        self.walk_expr(stmt, state)
+        if isinstance(stmt, Return):
+            return None
+        elif isinstance(stmt, Store) and stmt.name in self.names and state:
+            web = self.store_webs.get(stmt)
+            if web is None:
+                web = self.store_webs[stmt] = Web(stmt.name)
+                web.stores.append(stmt)
+            state = dict(state)
+            state[stmt.name] = frozenset([web])
+        return state
+
+    # Type propagation
+    def expr_type(self, node):
+        if isinstance(node, IntConst):
+            return 'int' if -(1 << 63) <= node.value < (1 << 63) else 'any'
+        elif isinstance(node, BoolConst):
+            return 'bool'
+        elif isinstance(node, NullConst):
+            return None
+        elif isinstance(node, IntValue):
+            return 'int'
+        elif isinstance(node, FixedArg):
+            return 'int' if node.native else 'any'
+        elif isinstance(node, Load):
+            web = self.load_webs.get(node)
+            if web is None or web.find().from_entry:
+                return 'any'
+            return web.find().type
+        elif isinstance(node, Identifier):
+            return self.temp_types.get(node.name, 'any')
+        elif isinstance(node, BinaryOp):
+            return binary_op_type(node.op, self.expr_type(node.lhs()),
+                    self.expr_type(node.rhs()))
+        elif isinstance(node, UnaryOp):
+            return unary_op_type(node.op, self.expr_type(node.rhs()))
+        return 'any'
+
+    def native_type(self, node):
+        t = self.expr_type(node)
+        return t if t in native_ctypes else None
+
+    def infer(self, stmts):
+        # Temporaries from get_temp_id() are typed without regard to flow.
+        # Only plain node temporaries can be unboxed.
+        for edge in stmts:
+            for node in edge().iterate_subtree():
+                if isinstance(node, Assign):
+                    name = node.target().name
+                    self.temp_assigns.setdefault(name, []).append(node)
+        for name, assigns in self.temp_assigns.items():
+            if all(a.target_type in ('node', None) for a in assigns):
+                self.temp_types[name] = None
+
+        webs = {web.find() for web in self.store_webs.values()}
+        webs = [web for web in webs if not web.from_entry]
+        changed = True
+        while changed:
+            changed = False
+            for web in webs:
+                t = web.type
+                for store in web.stores:
+                    t = join_types(t, self.expr_type(store.expr()))
+                if t != web.type:
+                    web.type = t
+                    changed = True
+            for name in self.temp_types:
+                t = self.temp_types[name]
+                for assign in self.temp_assigns[name]:
+                    t = join_types(t, self.expr_type(assign.expr()))
+                if t != self.temp_types[name]:
+                    self.temp_types[name] = t
+                    changed = True
+        self.loaded_webs = {web.find() for web in self.load_webs.values()}
+
+    # Rewriting: mark native nodes with their C++ type, and box native values
+    # that are used in a generic context.
+    def native_name(self, web):
+        web = web.find()
+        if web not in self.native_names:
+            name = 'unboxed_%s_%s' % (web.name, len(self.native_names))
+            self.native_names[web] = name
+            self.decls.append('%s %s = 0;' % (native_ctypes[web.type], name))
+        return self.native_names[web]
+
+    def native_const(self, ctype, value):
+        node = IntConst(value) if ctype == 'int' else BoolConst(bool(value))
+        node.ctype = ctype
+        return node
+
+    def rewrite_block(self, stmts):
+        for edge in stmts:
+            self.rewrite_stmt(edge())
+
+    def rewrite_stmt(self, stmt):
+        if isinstance(stmt, Store) and stmt in self.store_webs:
+            web = self.store_webs[stmt].find()
+            # Native variables that are never loaded, like the target of a
+            # range loop that only counts, don't need to be stored at all
+            if (not web.from_entry and web.type in native_ctypes and
+                    web not in self.loaded_webs and
+                    isinstance(stmt.expr(), (Load, IntConst, BoolConst))):
+                stmt.dead = True
+                return
+            if not web.from_entry and web.type in native_ctypes:
+                stmt.ctype = web.type
+                stmt.native_name = self.native_name(web)
+                self.rewrite_edge(stmt.expr, True)
+                return
+        elif isinstance(stmt, Assign):
+            ctype = self.temp_types.get(stmt.target().name)
+            if ctype in native_ctypes:
+                stmt.ctype = stmt.target().ctype = ctype
+                if isinstance(stmt.expr(), NullConst):
+                    stmt.expr.set(self.native_const(ctype, 0))
+                else:
+                    self.rewrite_edge(stmt.expr, True)
+            else:
+                self.rewrite_edge(stmt.expr, False)
+            return
+
+        for block in stmt.iterate_blocks():
+            self.rewrite_block(block)
+        for edge in stmt.iterate_edges():
+            self.rewrite_edge(edge, False)
+
+    def rewrite_edge(self, edge, native):
+        node = edge()
+        if isinstance(node, (Test, IntValue)):
+            self.rewrite_edge(node.expr, self.native_type(node.expr()) is not None)
+            if isinstance(node, IntValue):
+                node.ctype = 'int' if native else None
+            return
+
+        ctype = self.native_type(node)
+        if ctype is None:
+            assert not native
+            for child in node.iterate_edges():
+                self.rewrite_edge(child, False)
+            return
+
+        if isinstance(node, (IntConst, BoolConst)):
+            if native:
+                edge.set(self.native_const(ctype, node.value))
+            return
+
+        node.ctype = ctype
+        if isinstance(node, Load):
+            node.native_name = self.native_name(self.load_webs[node])
+        for child in node.iterate_edges():
+            self.rewrite_edge(child, True)
+        if not native:
+            edge.set(Box(node))
+
+# Run type inference on a flattened block, over the given variable names. This
+# returns declarations for the native variables that are used.
+def infer_types(stmts, names):
+    inference = TypeInference(names)
+    entry = {name: frozenset([Web(name, from_entry=True)]) for name in names}
+    inference.walk_block(stmts, entry)
+    inference.infer(stmts)
+    inference.rewrite_block(stmts)
+    return inference.decls
+
+# Escape analysis for argument tuples. Callees only read their argument tuple,
+# and copy out whatever they keep, so a tuple temporary that is only filled in
+# and passed as the arguments of calls can live in the C++ frame instead of the
+# GC heap. All of its uses have to be in the block that declares it, which
+# keeps the C++ object in scope. It's dead after the last use, so that gets a
+# ClearRoot, in case the tuple is given a root slot later.
+def find_stack_tuples(stmts):
+    candidates = {}
+    for edge in stmts:
+        stmt = edge()
+        for block in stmt.iterate_blocks():
+            find_stack_tuples(block)
+        if (isinstance(stmt, Assign) and stmt.target_type == 'tuple' and
+                isinstance(stmt.expr(), Ref) and stmt.expr().args):
+            candidates[stmt.target().name] = stmt
+    if not candidates:
+        return
+
+    escaped = set()
+    last_use = {}
+    def walk_expr(node, i, allowed):
+        if isinstance(node, Identifier) and node.name in candidates:
+            last_use[node.name] = i
+            if not allowed:
+                escaped.add(node.name)
+        for edge in node.iterate_edges():
+            walk_expr(edge(), i, (isinstance(node, (Call, CallMethod)) and edge is node.args) or
+                    (isinstance(node, StoreSubscriptDirect) and edge is node.expr))
+
+    for i, edge in enumerate(stmts):
+        stmt = edge()
+        if stmt in candidates.values():
+            continue
+        walk_expr(stmt, i, False)
+        for block in stmt.iterate_blocks():
+            for inner in block:
+                for node in inner().iterate_subtree():
+                    if isinstance(node, Identifier) and node.name in candidates:
+                        escaped.add(node.name)
+
+    for name, assign in candidates.items():
+        if name in escaped:
+            continue
+        assign.stack = True
+        for edge in stmts:
+            stmt = edge()
+            if (isinstance(stmt, StoreSubscriptDirect) and
+                    isinstance(stmt.expr(), Identifier) and stmt.expr().name == name):
+                stmt.direct = True
+    for name, i in sorted(last_use.items(), key=lambda n: -n[1]):
+        if name not in escaped:
+            stmts.insert(i + 1, Edge(ClearRoot(Identifier(name))))
+
+# Direct calls. A function defined at the top level of a module, whose name
+# isn't bound anywhere else, has the same value whenever it can be called. This
+# returns those functions by name, leaving out ones with *args, which would
+# need a tuple made for every call.
+def constant_functions(ctx, stmts):
+    stores = {}
+    scopes = [(stmts, None)] + [(scope.stmts, get_globals_locals(scope)[0])
+            for scope in ctx.functions + ctx.classes]
+    for block, scope_globals in scopes:
+        for edge in block:
+            for node in edge().iterate_subtree():
+                if isinstance(node, Store) and (scope_globals is None or
+                        node.name in scope_globals):
+                    stores.setdefault(node.name, []).append(node)
+    return {fn.name: fn for fn in ctx.functions
+            if stores.get(fn.name) == [fn.def_store] and not fn.arguments.vararg}
+
+# Calls of those functions by name become a DirectCall, unless a local of the
+# enclosing function or class shadows the name. The arguments are flattened
+# into statements that fill in an argument tuple and keyword dict, so those
+# become assignments to temporaries, which are passed to the parameters they
+# are bound to. Keyword arguments are bound here, at compile time. Calls that
+# can't be bound, like ones with too many arguments, are left alone so they
+# fail at run time as before.
+def find_direct_calls(ctx, stmts, functions, local_names):
+    temps = {}
+    fills = {}
+    for edge in stmts:
+        stmt = edge()
+        for block in stmt.iterate_blocks():
+            find_direct_calls(ctx, block, functions, local_names)
+        if (isinstance(stmt, Assign) and isinstance(stmt.expr(), Ref) and
+                stmt.expr().ref_type in ('tuple', 'dict')):
+            temps[stmt.target().name] = edge
+            fills[stmt.target().name] = []
+        else:
+            target = None
+            if isinstance(stmt, StoreSubscriptDirect):
+                target = stmt.expr()
+            elif isinstance(stmt, StoreSubscript):
+                target = stmt.name()
+            if isinstance(target, Identifier) and target.name in temps:
+                fills[target.name].append(edge)
+
+    def call_edges(edge):
+        if isinstance(edge(), Call):
+            yield edge
+        for child in edge().iterate_edges():
+            yield from call_edges(child)
+
+    def bind(call):
+        func, args, kwargs = call.func(), call.args(), call.kwargs()
+        if (not isinstance(func, Load) or func.name in local_names or
+                func.name not in functions):
+            return None
+        fn = functions[func.name]
+        if not isinstance(args, Identifier) or args.name not in temps:
+            return None
+        arg_temps = [args.name]
+        if isinstance(kwargs, Identifier) and kwargs.name in temps:
+            arg_temps.append(kwargs.name)
+        elif not isinstance(kwargs, NullConst):
+            return None
+
+        names = fn.arguments.names
+        if temps[args.name]().expr().args[0] > len(fn.arguments.args):
+            return None
+        params = [None] * len(names)
+        for fill in fills[args.name]:
+            params[fill().index] = fill
+        for fill in fills[arg_temps[-1]] if len(arg_temps) > 1 else []:
+            key = fill().index()
+            if not isinstance(key, StringConst) or key.value not in names:
+                return None
+            i = names.index(key.value)
+            if params[i]:
+                return None
+            params[i] = fill
+        if not all(params[:fn.arguments.n_required]):
+            return None
+
+        call_args = []
+        for fill in params:
+            if not fill:
+                call_args.append(NullConst())
+                continue
+            value = fill().value() if isinstance(fill(), StoreSubscriptDirect) else fill().expr()
+            temp = ctx.get_temp()
+            fill.set(Assign(Identifier(temp), value, 'node'))
+            call_args.append(Identifier(temp))
+        dropped.update(temps[name] for name in arg_temps)
+        return DirectCall(fn, call_args)
+
+    dropped = set()
+    for edge in stmts:
+        for call_edge in list(call_edges(edge)):
+            direct_call = bind(call_edge())
+            if direct_call:
+                call_edge.set(direct_call)
+    stmts[:] = [edge for edge in stmts if edge not in dropped]
+
+# Int specializations. A function whose parameters are used as ints gets a
+# clone where they are native ints, so type inference can unbox what's
+# computed from them. The generic entry point checks for int arguments and
+# calls it, and so do direct calls with native int arguments. To find the
+# parameters, type inference is run on a trial clone with every parameter
+# that has no default as an int, to see which of them are used natively.
+def specialize_functions(ctx):
+    shared = {id(fn): fn for fn in ctx.functions}
+    for fn in list(ctx.functions):
+        candidates = set(range(fn.arguments.n_required))
+        if not candidates:
+            continue
+        trial = int_clone(fn, candidates, shared)
+        infer_types(trial.stmts, get_globals_locals(fn)[1])
+        nodes = list(trial.iterate_subtree())
+        boxed = {id(node.expr()) for node in nodes if isinstance(node, Box)}
+        native_loads = {node.name for node in nodes if isinstance(node, Load) and
+                node.ctype == 'int' and id(node) not in boxed}
+        int_params = {i for i in candidates if fn.arguments.names[i] in native_loads}
+        if int_params:
+            fn.int_clone = int_clone(fn, int_params, shared)
+            ctx.functions.append(fn.int_clone)
+
+def int_clone(fn, int_params, shared):
+    clone = copy.copy(fn)
+    # Direct calls in the body still refer to the original functions
+    clone.stmts = copy.deepcopy(fn.stmts, dict(shared))
+    clone.int_params = int_params
+    clone.uses = []
+    for node in clone.iterate_subtree():
+        if isinstance(node, FixedArg) and node.index in int_params:
+            node.native = True
+    return clone
+
+# Root slots. Temporaries declared with Assign are plain C++ locals that the GC
+# can't see, so any that hold a node across a point where the GC can run (a
+# collection, or a call into user code that might reach one) get a slot in the
+# frame's root array, which the context scans. Slots are given out by linear
+# scan over the live ranges of the temporaries in a flattened block, so
+# temporaries that are never live at the same time share a slot. This returns
+# the new block and the number of slots used.
+def assign_root_slots(stmts, array):
+    temps = {}
+    gc_points = []
+
+    def walk_block(block, loop_stack):
+        for edge in block:
+            walk_stmt(edge(), loop_stack)
+
+    def walk_stmt(stmt, loop_stack):
+        pos = len(gc_points)
+        gc_points.append(False)
+        if isinstance(stmt, Assign) and stmt.target_type and not stmt.ctype:
+            temps[stmt.target().name] = [pos, pos, loop_stack]
+        elif isinstance(stmt, ClearRoot):
+            return
+        nodes = [stmt] + [node for edge in stmt.iterate_edges()
+                for node in edge().iterate_subtree()]
+        for node in nodes:
+            if isinstance(node, (Call, CallMethod, DirectCall, CollectGarbage)):
+                gc_points[pos] = True
+            elif isinstance(node, Identifier) and node.name in temps:
+                use_temp(node.name, pos, loop_stack)
+        for block in stmt.iterate_blocks():
+            if isinstance(stmt, While):
+                loop = [pos, pos]
+                walk_block(block, loop_stack + [loop])
+                loop[1] = len(gc_points) - 1
+            else:
+                walk_block(block, loop_stack)
+
+    def use_temp(name, pos, loop_stack):
+        temp = temps[name]
+        temp[1] = max(temp[1], pos)
+        # A temporary used in a loop it was defined outside of stays live for
+        # every iteration. Loop ends aren't known yet, so keep the loop itself.
+        if len(loop_stack) > len(temp[2]):
+            temp.append(loop_stack[len(temp[2])])
+
+    walk_block(stmts, [])
+
+    # Find the live range of each temporary, and whether it spans a GC point
+    ranges = []
+    for name, (start, end, _, *outer_loops) in temps.items():
+        # Live around the back edge, which is just after the loop's last statement
+        for loop in outer_loops:
+            end = max(end, loop[1] + 1)
+        if any(gc_points[start+1:end]):
+            ranges.append((start, end, name))
+
+    slots = {}
+    free_at = []
+    for start, end, name in sorted(ranges):
+        for i, slot_end in enumerate(free_at):
+            if slot_end < start:
+                break
+        else:
+            i = len(free_at)
+            free_at.append(None)
+        free_at[i] = end
+        slots[name] = '%s[%s]' % (array, i)
+
+    def rewrite_block(block):
+        new_block = []
+        for edge in block:
+            stmt = edge()
+            if isinstance(stmt, ClearRoot):
+                if stmt.name().name not in slots:
+                    continue
+                stmt.root = slots[stmt.name().name]
+            elif isinstance(stmt, Assign) and not stmt.ctype:
+                stmt.root = slots.get(stmt.target().name)
+            for inner in stmt.iterate_blocks():
+                inner[:] = rewrite_block(inner)
+            new_block.append(edge)
+        return new_block
+
+    return rewrite_block(stmts), len(free_at)
+
 @node('name, $stmts, exp_name, is_builtin')
 class FunctionDef(Node):
+    # The specialization of this function for int arguments, from
+    # specialize_functions(), and in a specialization, the indices of the
+    # parameters that are native ints
+    int_clone = None
+    int_params = None
+
     def setup(self):
         self.exp_name = self.exp_name if self.exp_name else self.name
         self.exp_name = 'fn_%s' % self.exp_name # make sure no name collisions
+        self.arguments = self.stmts[0]()
+        assert isinstance(self.arguments, Arguments)
 
     def reduce(self, ctx):
         self.module = ctx.module
         ctx.add_function(self)
         if self.is_builtin:
-            # HACK: just putting python string in args list
-            # also (safely...?) assuming identifiers don't need escapes
-            return Store(self.name, Ref('builtin_function_def', ['"%s"' % self.name, Identifier(self.exp_name)]))
-        return Store(self.name, Ref('function_def', [Identifier(self.exp_name)]))
+            self.def_store = Store(self.name, SingletonRef('builtin_function_%s' % self.exp_name))
+            return self.def_store
+        self.def_store = Store(self.name, Ref('function_def', [Identifier(self.exp_name),
+            Identifier('&%s_info' % self.exp_name)]))
+        return self.def_store
 
     def set_binding(self, ctx):
         all_globals, all_locals = get_globals_locals(self)
 
         self.local_count = len(all_locals)
+        self.local_names = all_locals
         self.has_globals = bool(all_globals)
 
         local_idx = {symbol: idx for idx, symbol in enumerate(sorted(all_locals))}
@@ -1099,21 +2021,106 @@ class FunctionDef(Node):
         stmts = block_str(self.stmts)
         glbls = '        context *globals = &ctx_%s;\n' % self.module if \
                 self.has_globals else ''
+        decls = ''.join('    %s\n' % d for d in self.unboxed_decls)
+        if self.root_count:
+            roots = '    node *root_slots[%s] = {};\n' % self.root_count
+            ctx_args = '%s, local_syms, %s, root_slots' % (self.local_count,
+                    self.root_count)
+        else:
+            roots = ''
+            ctx_args = '%s, local_syms' % self.local_count
+        frame = """    node *local_syms[{local_count}] = {{}};
+{roots}    context ctx[1] = {{context(parent_ctx, {ctx_args})}};
+""".format(local_count=self.local_count, roots=roots, ctx_args=ctx_args)
+        if not self.needs_frame():
+            frame = ''
+        frame += glbls + decls + stmts
+        if self.int_params is not None:
+            return """
+{proto} {{
+{frame}
+}}""".format(proto=self.prototype(), frame=frame)
+
+        args = self.arguments
+        if args.names:
+            arg_names = '%s_arg_names' % self.exp_name
+            names_decl = 'const char *%s[] = {%s};' % (arg_names,
+                    ', '.join('"%s"' % a for a in args.names))
+        else:
+            arg_names, names_decl = 'NULL', ''
+        n_params = self.n_params()
+        # Calls with ints for all the parameters of the int specialization go
+        # there instead
+        guard = ''
+        if self.int_clone:
+            int_params = sorted(self.int_clone.int_params)
+            guard = """    if ({test})
+        return {name}_int(parent_ctx{args});
+""".format(name=self.exp_name,
+            test=' && '.join('node_is_int(arg%d)' % i for i in int_params),
+            args=''.join(', node_int_value(arg%d)' % i if i in int_params else
+                ', arg%d' % i for i in range(n_params)))
         body = """
+{names_decl}
+{proto} {{
+{guard}{frame}
+}}
+node *{name}_fixed(context *parent_ctx, node **args) {{
+    return {name}_direct(parent_ctx{fixed_args});
+}}
+function_info {name}_info = {{"{pyname}", {name}_fixed, {n_args}, {n_required}, {n_kwonly}, {vararg}, {arg_names}}};
 node *{name}(context *parent_ctx, tuple *args, dict *kwargs) {{
-    node *local_syms[{local_count}] = {{}};
-    context ctx[1] = {{context(parent_ctx, {local_count}, local_syms)}};
-{glbls}{stmts}
-}}""".format(name=self.exp_name, glbls=glbls, local_count=self.local_count,
-        stmts=stmts)
+    node *params[{n_array}];
+    bind_arguments(&{name}_info, args, kwargs, params);
+    return {name}_fixed(parent_ctx, params);
+}}""".format(name=self.exp_name, pyname=self.name, proto=self.prototype(),
+        guard=guard, frame=frame, names_decl=names_decl, arg_names=arg_names,
+        fixed_args=''.join(', args[%d]' % i for i in range(n_params)),
+        n_args=len(args.args), n_required=args.n_required,
+        n_kwonly=len(args.kwonlyargs), vararg='true' if args.vararg else 'false',
+        n_array=max(n_params, 1))
+        if self.is_builtin:
+            # XXX (safely...?) assuming identifiers don't need escapes
+            body += '\nbuiltin_function_def builtin_function_{name}("{pyname}", {name}, &{name}_info);'.format(
+                    name=self.exp_name, pyname=self.name)
         return body
 
+    # Functions that only work on native values, like int specializations of
+    # simple functions, don't need a frame at all. Anything that calls out,
+    # collects garbage, or uses the symbol table does.
+    def needs_frame(self):
+        if self.root_count:
+            return True
+        for edge in self.stmts:
+            for node in edge().iterate_subtree():
+                if isinstance(node, (Call, CallMethod, DirectCall, CollectGarbage)):
+                    return True
+                if isinstance(node, (Load, Store)) and not node.ctype and not (
+                        isinstance(node, Store) and node.dead):
+                    return True
+        return False
+
+    # Parameters of the direct entry point: the positional ones, keyword-only
+    # ones, and *args
+    def n_params(self):
+        return len(self.arguments.names) + bool(self.arguments.vararg)
+
+    def prototype(self):
+        params = ''.join(', %sarg%d' % ('int_t ' if self.int_params and i in self.int_params
+            else 'node *', i) for i in range(self.n_params()))
+        suffix = 'int' if self.int_params is not None else 'direct'
+        return 'node *%s_%s(context *parent_ctx%s)' % (self.exp_name, suffix, params)
+
 @node('name, $stmts')
 class ClassDef(Node):
+    # Attributes that instances store inline, and whether they came from
+    # __slots__, set by the transformer
+    fields = []
+    fixed_fields = False
+
     def setup(self):
         self.class_name = 'class_%s' % self.name
         self.class_inst = '%s_singleton' % self.class_name
-        self.obj_name = '%s_obj' % self.class_name
 
     def reduce(self, ctx):
         self.module = ctx.module
@@ -1132,49 +2139,45 @@ class ClassDef(Node):
 
         return all_globals
 
-    def __str__(self):
-        stmts = block_str(self.stmts, spaces=8)
-        glbls = '        context *globals = &ctx_%s;\n' % self.module if \
-                self.has_globals else ''
-        body = """
+    def declaration(self):
+        return """
 class {cname}: public class_def {{
 public:
-    {cname}() {{
-{glbls}{stmts}
-    }}
+    {cname}();
     virtual std::string repr() {{
         return std::string("<class '{name}'>");
     }}
     virtual node *__call__(context *ctx, tuple *args, dict *kwargs);
     virtual const char *type_name() {{ return "{cname}"; }}
-}} {cinst};
-class {oname}: public object {{
-public:
-    virtual node *getattr(const char *key) {{
-        auto attr = this->lookup(key);
-        if (attr)
-            return attr;
-        if (!strcmp(key, "__class__"))
-            return &{cinst};
-        return pc_new(bound_method)(this, {cinst}.getattr(key));
-    }}
-    virtual node *type() {{ return &{cinst}; }}
 }};
+extern {cname} {cinst};""".format(name=self.name, cname=self.class_name, cinst=self.class_inst)
+
+    def __str__(self):
+        stmts = block_str(self.stmts, spaces=4)
+        glbls = '    context *globals = &ctx_%s;\n' % self.module if \
+                self.has_globals else ''
+        if self.fields:
+            fields = '%s_fields' % self.class_name
+            field_decl = 'const char *%s[] = {%s};' % (fields,
+                    ', '.join('"%s"' % f for f in self.fields))
+        else:
+            fields, field_decl = 'NULL', ''
+        body = """
+{field_decl}
+{cname}::{cname}(): class_def({n_fields}, {fields}, {fixed}) {{
+{glbls}{stmts}
+}}
+{cname} {cinst};
 node *{cname}::__call__(context *ctx, tuple *args, dict *kwargs) {{
     node *init = this->getattr("__init__");
-    object *obj = pc_new({oname})();
-    if (!init)
-        return obj;
-    int_t len = args->items.size();
-    tuple *new_args = pc_new(tuple)(len + 1);
-    new_args->items[0] = obj;
-    for (int_t i = 0; i < len; i++)
-        new_args->items[i+1] = args->items[i];
-    init->__call__(ctx, new_args, kwargs);
+    object *obj = create_object(this);
+    if (init)
+        call_with_self(ctx, init, obj, args, kwargs);
     return obj;
 }}
-""".format(name=self.name, cname=self.class_name, cinst=self.class_inst,
-        glbls=glbls, oname=self.obj_name, stmts=stmts)
+""".format(cname=self.class_name, cinst=self.class_inst, glbls=glbls,
+        stmts=stmts, field_decl=field_decl, n_fields=len(self.fields),
+        fields=fields, fixed='true' if self.fixed_fields else 'false')
         return body
 
 @node('name, from_names, path, *stmts')
@@ -21,6 +21,8 @@ for x in [[(1,2)]]:
 for x in [range(5)]:
     print(list(enumerate(x)))
 print(enumerate([]).__class__)
+for i, c in enumerate('abc'):
+    print(i, c)
 
 for x in [0, 1, False, True, '0', '1', '10', '15', '-123', '+714']:
     print(int(x))
@@ -74,6 +76,9 @@ print(list(zip([1, 2], [3, 4])))
 print(list(zip([1, 2, 3], [4, 5])))
 print(list(zip([1, 2,], [3, 4, 5])))
 print(zip([], []).__class__)
+for a, b in zip([1, 2, 3], 'xy'):
+    print(a, b)
+print([a + b for a, b in zip('ab', 'cd')])
 
 x = {x: x*x for x in range(10)}
 print(x.get(0, 5))
@@ -91,6 +96,12 @@ print(len(x))
 print(len(x.keys()))
 print(len(x.values()))
 print(len(x.items()))
+total = 0
+for k, v in x.items():
+    total += k * v
+print(total)
+for a, b in [(1, 2), 'cd', [3, 4]]:
+    print(a, b)
 
 x = []
 x.append(1)
@@ -106,3 +117,214 @@ for x in [[], ['a'], ['a', 'b', 'c'], ('x', 'y', 'z')]:
     print(','.join(x))
 for x in ['', 'a', ':', 'a:', 'a:b', 'a:b:c']:
     print(x.split(':'))
+for a, b in [('a', 'b'), ('ab', 'a'), ('abc', 'abc'), ('', 'a')]:
+    print(a == b, a != b)
+for a, b in [('a', 'b'), ('ab', 'a'), ('abc', 'abc'), ('', 'a')]:
+    print(a < b, a <= b, a > b, a >= b)
+
+x = {}
+for i in range(100):
+    x[i * 7 % 100] = i
+for i in range(0, 100, 3):
+    del x[i]
+for i in range(0, 30, 2):
+    x[i] = -i
+print(x)
+print(len(x), 3 in x, 4 in x, x[98])
+y = x.copy()
+y[1000] = 1
+print(len(x), len(y), list(y)[len(y) - 3:])
+y.clear()
+print(y, len(y))
+y[True] = 'a'
+y[1] = 'b'
+print(y)
+# 620445648566982762 is the hash of 'ab' here, so these keys collide
+y = {'ab': 1, 620445648566982762: 2, 'ba': 3}
+print(y['ab'], y[620445648566982762], y['ba'], 'x' in y)
+del y['ab']
+print(y, 620445648566982762 in y, 'ab' in y)
+
+a = {1, 2, 3, 4}
+b = {3, 4, 5}
+print(a & b, a | b, a - b, b - a, a ^ b, b ^ a)
+print(a <= b, {3, 4} <= a, {3, 4} < a, a < a, a >= {1}, a > a, a == {4, 3, 2, 1})
+print(a.issubset([1, 2, 3, 4, 5]), a.issuperset(range(3)), a.isdisjoint(b), a.isdisjoint([7, 8]))
+print(a.symmetric_difference(range(3, 7)))
+c = set(a)
+c &= b
+c |= {9}
+c ^= {4, 10}
+c -= {9}
+print(c)
+c.intersection_update([1, 3, 10], range(4, 11))
+print(c)
+f = frozenset([3, 1, 2])
+print(f, frozenset(), f | b, b | f, f & b, f.issubset(a), f == {1, 2, 3})
+g = f
+g |= {7}
+print(f, g, f.copy() is f, len({f, frozenset([1, 2, 3]), frozenset()}))
+x = set()
+for i in range(1000):
+    x.add(i * 37 % 1000)
+for i in range(0, 1000, 2):
+    x.discard(i)
+total = 0
+for i in x:
+    total += i
+print(len(x), 1 in x, 2 in x, total)
+print(sorted({'c', 'a', 'b'} | {'d', 'a'}), sorted({'a', 'b', 'c'} - {'b'}))
+
+x = [5, 3, 9, 3, 1]
+print(3 in x, 4 in x, 'a' in x, True in [0, 1], x.count(3), x.index(9), x == [5, 3, 9, 3, 1], x == [5, 3])
+x.sort()
+print(x, sorted([3, -7, 12, 0]), sorted(['pear', 'fig', 'apple', 'f']))
+y = ['b', 'a', 'c', 'a']
+print('a' in y, 'd' in y, 1 in y, y.count('a'), y.index('c'))
+y.remove('a')
+y.sort()
+print(y)
+z = x + y
+z.insert(1, None)
+z.append(x)
+print(z, z.count(3), None in z, 'c' in z, z.index('b'))
+z = x[1:3] + [4] * 2
+z[0] = 'q'
+print(z, z.index(4), 'q' in z)
+
+def neg(x):
+    return -x
+def second(x):
+    return x[1]
+def length(x):
+    return len(x)
+def swapped(x):
+    return (x[2], x[0])
+records = [(3, 'c', 1), (1, 'a', 2), (2, 'b', 2), (1, 'z', 0), (3, 'a', 5)]
+print(sorted(records), sorted([(2, 1), (1, 5), (2, 0), (1,)]))
+print(sorted(records, key=second), sorted(records, key=second, reverse=True))
+print(sorted(records, key=swapped))
+print(sorted([5, 1, 4, 1, 3], reverse=True), sorted(['b', 'A', 'c'], reverse=True), sorted([3, 1, 2], key=neg))
+words = ['ccc', 'a', 'bb', 'dd', 'e', 'fff']
+words.sort(key=length)
+print(words)
+words.sort(key=length, reverse=True)
+print(words)
+words.sort(reverse=False)
+print(words, (1, 2) < (1, 3), (1, 2) < (1, 2, 0), (2,) >= (1, 9), ('a', 1) <= ('a', 1))
+def seen_len(w):
+    return len(words) * 10 + len(w)
+words.sort(key=seen_len)
+print(words)
+
+def pack(*args):
+    return args
+big = tuple(range(600))
+x = (1, 2, 3, 4, 5, 6, 7)
+print(len(big), big[599], pack(*big)[300], pack(*x), pack(), tuple('abc'), tuple(x) == x)
+print(x[0:7:2], x[1:6:3], x[6:0:-2], x + (8,), x * 2, (1,) * 0)
+triples = [(i, str(i), [i]) for i in range(50)]
+print(triples[49], len(tuple(triples)), big[100:103] + big[598:])
+
+s = 'hello, world'
+print(s[0], s[-1], s[3:], s[:-3], s[-5:-1], s[::-1], s[::2], s[100:], s[-100:3], s[5:2], s[1:11:3])
+line = 'alpha,beta,gamma delta epsilon zeta,x,,yy'
+fields = line.split(',')
+words = fields[2].split(' ')
+print(fields, words, words[2][2:] + '!', words[0] == 'gamma', int('x12345678901234'[1:13]), [c for c in words[3]])
+print(x[-2:], x[::-1], x[1:-1], x[4:0:-2], big[-3:], big[::-200], x[:] == x, x[-100:100])
+
+class Shaped:
+    kind = 'shaped'
+    def __init__(self, flag):
+        if flag:
+            self.a = 1
+            self.b = 2
+        else:
+            self.b = 3
+            self.a = 4
+            self.c = 5
+    def total(self):
+        return self.a + self.b
+objs = [Shaped(i % 3 == 0) for i in range(9)]
+n = 0
+for o in objs:
+    n += o.total() * 10 + o.a
+    o.b = o.a
+    o.a += 1
+    n += o.total()
+print(n, objs[1].c, objs[0].kind, isinstance(objs[2], Shaped))
+Shaped.kind = 'changed'
+objs[0].kind = 'own'
+print(objs[0].kind, objs[1].kind, Shaped.kind)
+
+class Point:
+    __slots__ = ('x', 'y')
+    def __init__(self, x, y):
+        self.x = x
+        self.y = y
+    def swap(self):
+        self.x, self.y = self.y, self.x
+        return self
+pts = [Point(i, i * 2) for i in range(5)]
+print(pts[2].swap().x, pts[2].y, pts[3].x)
+
+class Loose:
+    def __init__(self, v):
+        self.v = v
+loose = [Loose(i) for i in range(4)]
+for o in loose:
+    o.a = o.v + 1
+    o.b = o.a + 1
+    o.c = o.b + 1
+    o.d = o.c + 1
+    o.e = o.d + 1
+    o.v += o.e
+loose[1].w = 'w'
+print(loose[3].v, loose[2].e, loose[1].w, loose[0].a)
+
+class Calls:
+    def __init__(self):
+        self.fn = len
+    def many(self, a, b, c, d, e, f, g, h, i):
+        return a + b + c + d + e + f + g + h + i
+calls = Calls()
+bound = calls.many
+print(calls.many(1, 2, 3, 4, 5, 6, 7, 8, 9), bound(*range(9)), calls.fn('abc'))
+print(Shaped.total(objs[0]), 'a,b'.split(','), [3, 1, 2].index(2))
+
+def scaled(x, y=2, *rest, scale=1):
+    return (x + y + len(rest)) * scale
+print(scaled(1), scaled(1, 3), scaled(1, 3, 5, 7), scaled(y=4, x=1), scaled(1, scale=10))
+def affine(a, b=1):
+    return a * 10 + b
+print(affine(2), affine(2, 3), affine(b=5, a=1), calls.many(*range(1, 10)))
+
+def collatz(n, limit):
+    steps = 0
+    while n != 1 and steps < limit:
+        if n % 2:
+            n = 3 * n + 1
+        else:
+            n //= 2
+        steps += 1
+    return steps
+def tri(n):
+    if n <= 0:
+        return 0
+    return n + tri(n - 1)
+def twice(x):
+    return x + x
+print(collatz(27, 1000), collatz(limit=5, n=7), collatz(27, True), tri(50), tri(True))
+print(twice(21), twice('ab'), twice([1]), twice(x=False))
+
+class Order:
+    def f(self, x):
+        return 'class'
+def inst(x):
+    return 'inst'
+order = Order()
+def change():
+    order.f = inst
+    return 1
+print(order.f(change()), order.f(2), Order().f(3))
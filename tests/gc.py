@@ -0,0 +1,55 @@
+# Deep structures have to be marked without recursion
+l = None
+for i in range(1000000):
+    l = (i, l)
+n = 0
+while l:
+    n += l[0]
+    l = l[1]
+print(n)
+
+# Containers that get dropped and rebuilt, with a live set that stays around
+keep = {}
+for i in range(100000):
+    items = [i, str(i), (i, i + 1), {i: i}]
+    if i % 1000 == 0:
+        keep[i] = items
+print(len(keep), keep[99000], items)
+
+# Old containers that get new objects stored in them between collections
+class Holder:
+    pass
+holder = Holder()
+kept = []
+table = {}
+seen = set()
+for i in range(300000):
+    junk = [i, [i], (i, i)]
+    kept.append([i])
+    table[i % 1000] = (i, [i])
+    seen.add(str(i % 777))
+    holder.last = [i, junk]
+    if i % 1000 == 0:
+        kept[i // 2] = [i // 2]
+total = 0
+for x in kept:
+    total += x[0]
+print(total, len(kept))
+total = 0
+for k in table:
+    total += table[k][1][0]
+print(total, len(table))
+print(len(seen), holder.last[0], holder.last[1][1])
+
+# Temporaries that are half built while a call collects garbage
+def churn(n):
+    junk = []
+    for i in range(n):
+        junk.append([i, str(i)])
+    return len(junk)
+total = 0
+for i in range(20):
+    pair = [str(i), churn(2000), (str(i), churn(100))]
+    squares = [[j * j, churn(10)] for j in range(50)]
+    total += len(pair[0]) + pair[1] + pair[2][1] + squares[49][0] + len(squares)
+print(total)
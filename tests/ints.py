@@ -0,0 +1,44 @@
+# Ints around the boundary of the tagged representation
+big = 4611686018427387903
+for x in [0, 1, -1, big, -big - 1]:
+    y = x + 1
+    z = x - 1
+    print(x, y, z, y - 1 == x, z + 1 == x, y > x, z < x)
+    print({y: 1}[x + 1], [x, y, z].index(y), y in {z, y})
+
+x = big
+x += 1
+print(x, x * 1, x // 2, x - big, -x)
+print(abs(-big - 1), big | (big + 1), (big + 1) & big, (big + 1) ^ 1)
+print(int(str(big + 1)) == big + 1, sorted([big + 1, 0, -big - 2, big]))
+
+# Identity and equality of small ints
+a = 1000
+b = 999 + 1
+print(a == b, a != b, a < b, a >= b)
+print(True + 1, 1 + True, True & 1, (5).__class__)
+print([a * b for a, b in zip(range(5), range(2, 7))])
+
+# Variables that are only ints/bools in some places, and range() loops
+def count(n):
+    total = 0
+    flag = False
+    for i in range(n, -n, -2):
+        total += i * i
+        flag = flag ^ (i > 2)
+        if i == 3:
+            continue
+    x = total
+    if flag:
+        x = str(total)
+    return total, flag, x
+
+print(count(5), count(6), [j for j in range(8, 2, -3)])
+for i in range(3):
+    pass
+print(i)
+i = 'done'
+print(i, [i for i in range(2, 10, 3)], not 0, -True, ~5)
+while i:
+    i = 0
+print(i, i < 1 and i > -1, i or 7)
@@ -36,11 +36,76 @@ class TranslateError(Exception):
     def __init__(self, node, msg):
         super().__init__('error at line %s: %s' % (node.lineno, msg))
 
+# Check whether a module might bind the given name to something else
+def module_binds_name(node, name):
+    for child in ast.walk(node):
+        if isinstance(child, ast.Name) and isinstance(child.ctx, ast.Store):
+            if child.id == name:
+                return True
+        elif isinstance(child, (ast.FunctionDef, ast.ClassDef)):
+            if child.name == name:
+                return True
+        elif isinstance(child, ast.arg):
+            if child.arg == name:
+                return True
+        elif isinstance(child, ast.arguments):
+            if child.vararg == name:
+                return True
+        elif isinstance(child, ast.ImportFrom):
+            if child.module != '__builtins__' and any(a.name == '*' for a in child.names):
+                return True
+        elif isinstance(child, ast.alias):
+            if (child.asname or child.name) == name:
+                return True
+    return False
+
+# The name of self in a method, if it's never assigned to, so it's always the
+# instance the method was called on (or, if called through the class, the
+# first argument)
+def method_self_name(node):
+    if not node.args.args:
+        return None
+    name = node.args.args[0].arg
+    for n in ast.walk(node):
+        if isinstance(n, ast.Name) and n.id == name and not isinstance(n.ctx, ast.Load):
+            return None
+    return name
+
+# The attributes instances of a class have as fields: the names in __slots__,
+# if the class has it, or else every attribute its methods store on self.
+# Returns the names in order, and whether they came from __slots__.
+def class_fields(node):
+    for stmt in node.body:
+        if (isinstance(stmt, ast.Assign) and len(stmt.targets) == 1 and
+                isinstance(stmt.targets[0], ast.Name) and
+                stmt.targets[0].id == '__slots__'):
+            if not (isinstance(stmt.value, (ast.List, ast.Tuple)) and
+                    all(isinstance(e, ast.Str) for e in stmt.value.elts)):
+                raise TranslateError(stmt, '__slots__ must be a list of strings')
+            return [e.s for e in stmt.value.elts], True
+    fields = []
+    for fn in node.body:
+        if not isinstance(fn, ast.FunctionDef):
+            continue
+        self_name = method_self_name(fn)
+        for n in ast.walk(fn):
+            if (isinstance(n, ast.Attribute) and isinstance(n.ctx, ast.Store) and
+                    isinstance(n.value, ast.Name) and n.value.id == self_name and
+                    n.attr not in fields):
+                fields.append(n.attr)
+    return fields, False
+
 class Transformer(ast.NodeTransformer):
     def __init__(self):
         self.statements = []
         self.in_class = False
         self.in_function = False
+        self.builtin_range = False
+        # The class being translated and its fields, and the name of self in
+        # the method being translated, if accesses to its fields can be direct
+        self.class_name = None
+        self.class_fields = {}
+        self.self_name = None
 
     def generic_visit(self, node):
         raise TranslateError(node, 'can\'t translate %s' % node)
@@ -176,14 +241,28 @@ class Transformer(ast.NodeTransformer):
                     [node.slice.lower, node.slice.upper, node.slice.step]]
             return syntax.Slice(l, start, end, step)
 
+    # The class and index of a field of self accessed by an attribute node
+    def self_field(self, node):
+        if (self.self_name and isinstance(node.value, ast.Name) and
+                node.value.id == self.self_name and node.attr in self.class_fields):
+            return (self.class_name, self.class_fields[node.attr])
+        return None
+
     def visit_Attribute(self, node):
         assert isinstance(node.ctx, ast.Load)
         l = self.visit(node.value)
         attr = syntax.Attribute(l, syntax.StringConst(node.attr))
+        attr.field = self.self_field(node)
         return attr
 
     def visit_Call(self, node):
-        fn = self.visit(node.func)
+        # Calls of an attribute look up the method and call it with obj as
+        # self, without making a bound method
+        if isinstance(node.func, ast.Attribute):
+            obj = self.visit(node.func.value)
+            method = syntax.StringConst(node.func.attr)
+        else:
+            fn = self.visit(node.func)
 
         if node.starargs:
             assert not node.args
@@ -202,6 +281,8 @@ class Transformer(ast.NodeTransformer):
             values = [self.visit(i.value) for i in node.keywords]
             kwargs = syntax.Dict(keys, values)
 
+        if isinstance(node.func, ast.Attribute):
+            return syntax.CallMethod(obj, method, args, kwargs, None)
         return syntax.Call(fn, args, kwargs)
 
     def visit_Assign(self, node):
@@ -221,7 +302,9 @@ class Transformer(ast.NodeTransformer):
                 return stmts
             elif isinstance(target, ast.Attribute):
                 base = self.visit(target.value)
-                return [syntax.StoreAttr(base, syntax.StringConst(target.attr), value)]
+                store = syntax.StoreAttr(base, syntax.StringConst(target.attr), value)
+                store.field = self.self_field(target)
+                return [store]
             elif isinstance(target, ast.Subscript):
                 assert isinstance(target.slice, ast.Index)
                 base = self.visit(target.value)
@@ -247,8 +330,11 @@ class Transformer(ast.NodeTransformer):
             l = self.visit(node.target.value)
             attr_name = syntax.StringConst(node.target.attr)
             attr = syntax.Attribute(l, attr_name)
+            attr.field = self.self_field(node.target)
             binop = syntax.BinaryOp(op, attr, value)
-            return [syntax.StoreAttr(l, attr_name, binop)]
+            store = syntax.StoreAttr(l, attr_name, binop)
+            store.field = attr.field
+            return [store]
         elif isinstance(node.target, ast.Subscript):
             assert isinstance(node.target.slice, ast.Index)
             base = self.visit(node.target.value)
@@ -284,9 +370,35 @@ class Transformer(ast.NodeTransformer):
     def visit_Continue(self, node):
         return syntax.Continue()
 
+    # Check for range() with a constant step, which For can count directly
+    def get_range_iter(self, node):
+        if (not self.builtin_range or not isinstance(node, ast.Call) or
+                not isinstance(node.func, ast.Name) or node.func.id != 'range' or
+                node.keywords or node.starargs or node.kwargs or
+                not 1 <= len(node.args) <= 3):
+            return None
+        step = 1
+        if len(node.args) == 3:
+            step = self.visit(node.args[2])
+            if isinstance(step, syntax.UnaryOp) and step.op == '__neg__':
+                step = step.rhs()
+                if isinstance(step, syntax.IntConst):
+                    step = syntax.IntConst(-step.value)
+            if not isinstance(step, syntax.IntConst) or not step.value:
+                return None
+            step = step.value
+        args = [self.visit(arg) for arg in node.args[:2]]
+        if len(args) == 1:
+            args = [syntax.IntConst(0)] + args
+        return syntax.RangeIter(args[0], args[1], step)
+
     def visit_For(self, node):
         assert not node.orelse
-        iter = self.visit(node.iter)
+        iter = None
+        if isinstance(node.target, ast.Name):
+            iter = self.get_range_iter(node.iter)
+        if iter is None:
+            iter = self.visit(node.iter)
         stmts = self.visit_child_list(node.body)
         stmts.append(syntax.CollectGarbage(None))
 
@@ -399,11 +511,13 @@ class Transformer(ast.NodeTransformer):
 
         # Set some state and recursively visit child nodes, then restore state
         self.in_function = True
+        self.self_name = method_self_name(node) if self.in_class else None
         args = self.visit(node.args)
         body = [args] + self.visit_child_list(node.body)
         if not body or not isinstance(body[-1], syntax.Return):
             body.append(syntax.Return(None))
         self.in_function = False
+        self.self_name = None
 
         exp_name = node.exp_name if 'exp_name' in dir(node) else None
         return syntax.FunctionDef(node.name, body, exp_name, is_builtin)
@@ -421,11 +535,20 @@ class Transformer(ast.NodeTransformer):
             if isinstance(fn, ast.FunctionDef):
                 fn.exp_name = '_%s_%s' % (node.name, fn.name)
 
+        fields, fixed_fields = class_fields(node)
+
         self.in_class = True
+        self.class_name = node.name
+        self.class_fields = {name: i for i, name in enumerate(fields)}
         body = self.visit_child_list(node.body)
         self.in_class = False
+        self.class_name = None
+        self.class_fields = {}
 
-        return syntax.ClassDef(node.name, body)
+        cls = syntax.ClassDef(node.name, body)
+        cls.fields = fields
+        cls.fixed_fields = fixed_fields
+        return cls
 
     def gen_import(self, node, name, from_names=None):
         if name in syntax.builtin_modules:
@@ -471,6 +594,7 @@ class Transformer(ast.NodeTransformer):
         return self.visit(node.value)
 
     def visit_Module(self, node):
+        self.builtin_range = not module_binds_name(node, 'range')
         return self.visit_child_list(node.body)
 
     def visit_Global(self, node):